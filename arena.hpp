@@ -0,0 +1,178 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+
+namespace bot {
+
+    // Memory is committed to arenas in chunks of one huge page.
+    const uint64_t arena_chunk_bytes = (uint64_t)2 << 20;
+
+    // Committed bytes are counted against one limit for the whole process,
+    // whichever worker commits them.
+    struct memory_budget_t {
+        std::atomic<uint64_t> limit;
+        std::atomic<uint64_t> committed;
+        std::atomic<uint64_t> high_water;
+        std::atomic<bool> huge_pages;
+    };
+
+    inline uint64_t cgroup_memory_limit() {
+        uint64_t limit = 0;
+        std::ifstream memory_max("/sys/fs/cgroup/memory.max");
+        if (memory_max >> limit) {
+            return limit;
+        }
+        std::ifstream limit_in_bytes("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        if (limit_in_bytes >> limit) {
+            return limit;
+        }
+        return 0;
+    }
+
+    // Three quarters of the memory we may use, leaving the rest to the
+    // runner and the page cache. A cgroup without a limit reports either
+    // "max", which fails to parse, or a number larger than the machine.
+    inline uint64_t default_memory_budget() {
+        uint64_t physical = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        uint64_t limit = cgroup_memory_limit();
+        if (limit != 0) {
+            physical = std::min(physical, limit);
+        }
+        return physical / 4 * 3;
+    }
+
+    inline memory_budget_t& memory_budget() {
+        static memory_budget_t budget = {{default_memory_budget()}, {0}, {0}, {true}};
+        return budget;
+    }
+
+    inline void configure_memory(uint64_t limit, bool huge_pages) {
+        if (limit != 0) {
+            memory_budget().limit.store(limit);
+        }
+        memory_budget().huge_pages.store(huge_pages);
+    }
+
+    // Takes bytes from the budget unless forced past it. Forcing is for
+    // commits that cannot be refused, and only ever overshoots by what one
+    // iteration of a search allocates.
+    inline bool take_from_budget(uint64_t bytes, bool force) {
+        memory_budget_t& budget = memory_budget();
+        uint64_t committed = budget.committed.load();
+        do {
+            if (!force && committed + bytes > budget.limit.load()) {
+                return false;
+            }
+        } while (!budget.committed.compare_exchange_weak(committed, committed + bytes));
+        uint64_t high_water = budget.high_water.load();
+        while (committed + bytes > high_water &&
+               !budget.high_water.compare_exchange_weak(high_water, committed + bytes)) {
+        }
+        return true;
+    }
+
+    // A bump allocator over address space reserved with mmap but not
+    // backed by anything until it is committed, chunk by chunk, as the
+    // bump pointer reaches it. Reserving costs no memory, so every arena
+    // can reserve as much as the largest tree it may ever hold. Committed
+    // chunks stay committed when the arena is reset and are reused.
+    struct arena {
+        uint8_t* base;
+        uint64_t reserved;
+        std::atomic<uint64_t> used;
+        std::atomic<uint64_t> committed;
+        std::mutex commit_mutex;
+
+        arena() : base(0), reserved(0), used(0), committed(0) {
+        }
+
+        ~arena() {
+            if (base) {
+                munmap(base, reserved);
+            }
+            memory_budget().committed.fetch_sub(committed.load());
+        }
+    };
+
+    // An arena whose address space could not be reserved has none, and
+    // every commit to it fails.
+    inline bool reserve_arena(arena& arena, uint64_t bytes) {
+        assert(!arena.base);
+        uint64_t reserved = (bytes + arena_chunk_bytes - 1) / arena_chunk_bytes * arena_chunk_bytes;
+        void* address = mmap(0, reserved, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (address == MAP_FAILED) {
+            return false;
+        }
+        arena.reserved = reserved;
+        arena.base = static_cast<uint8_t*>(address);
+#ifdef MADV_HUGEPAGE
+        if (memory_budget().huge_pages.load()) {
+            madvise(arena.base, arena.reserved, MADV_HUGEPAGE);
+        }
+#endif
+        return true;
+    }
+
+    // Makes sure the first bytes of the arena are committed. Returns false
+    // when that would take the process over its budget, unless forced, or
+    // past what the arena reserved, or when the kernel refuses the memory.
+    inline bool commit_arena(arena& arena, uint64_t bytes, bool force) {
+        if (bytes <= arena.committed.load(std::memory_order_acquire)) {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(arena.commit_mutex);
+        uint64_t committed = arena.committed.load(std::memory_order_relaxed);
+        while (committed < bytes) {
+            if (committed + arena_chunk_bytes > arena.reserved ||
+                !take_from_budget(arena_chunk_bytes, force)) {
+                return false;
+            }
+            if (mprotect(arena.base + committed, arena_chunk_bytes, PROT_READ | PROT_WRITE)) {
+                memory_budget().committed.fetch_sub(arena_chunk_bytes);
+                return false;
+            }
+            committed += arena_chunk_bytes;
+            arena.committed.store(committed, std::memory_order_release);
+        }
+        return true;
+    }
+
+    const uint64_t cache_line_bytes = 64;
+
+    // What arena_allocate returns when the memory cannot be committed.
+    const uint64_t arena_full = (uint64_t)-1;
+
+    // Allocations are rounded to a cache line, so that every one starts on
+    // one. Callers keep room committed ahead of them with arena_has_room,
+    // and go past the budget rather than fail, but an allocation still
+    // fails if the arena runs out of address space or the kernel refuses
+    // to commit more. The arena is left full.
+    inline uint64_t arena_allocate(arena& arena, uint64_t bytes) {
+        bytes = (bytes + cache_line_bytes - 1) & ~(cache_line_bytes - 1);
+        uint64_t offset = arena.used.fetch_add(bytes, std::memory_order_relaxed);
+        if (!commit_arena(arena, offset + bytes, true)) {
+            return arena_full;
+        }
+        return offset;
+    }
+
+    inline bool arena_has_room(arena& arena, uint64_t bytes) {
+        return commit_arena(arena, arena.used.load(std::memory_order_relaxed) + bytes, false);
+    }
+
+    inline void reset_arena(arena& arena) {
+        arena.used.store(0, std::memory_order_relaxed);
+    }
+
+}
+
+#endif
@@ -0,0 +1,199 @@
+#include "search.hpp"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+
+namespace bench {
+
+    using namespace bot;
+
+    typedef std::chrono::steady_clock clock_t;
+
+    const std::chrono::milliseconds run_time(1000);
+
+    double seconds_since(clock_t::time_point start) {
+        return std::chrono::duration<double>(clock_t::now() - start).count();
+    }
+
+    template <typename rng_t>
+    void rollouts_per_second_scalar(const char* name, board_t& initial, uint16_t current_turn) {
+        rng_t rng;
+        seed_worker(rng, 1, 0);
+        board_t board;
+        uint64_t rollouts = 0;
+        clock_t::time_point start = clock_t::now();
+        while (clock_t::now() - start < run_time) {
+            copy_board(initial, board);
+            uint16_t a_move = select_move(rng, board.a);
+            uint16_t b_move = select_move(rng, board.b);
+            simulate(rng, board.a, board.b, a_move, b_move, current_turn);
+            rollouts++;
+        }
+        std::cout << "simulate        " << name << " "
+                  << rollouts / seconds_since(start) << " rollouts/sec" << std::endl;
+    }
+
+    template <typename rng_t>
+    void rollouts_per_second_batch(const char* name, board_t& initial, uint16_t current_turn) {
+        rng_t rng;
+        seed_worker(rng, 1, 0);
+        board_t boards[batch_width];
+        uint16_t a_moves[batch_width];
+        uint16_t b_moves[batch_width];
+        uint32_t final_turns[batch_width];
+        uint64_t rollouts = 0;
+        clock_t::time_point start = clock_t::now();
+        while (clock_t::now() - start < run_time) {
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                copy_board(initial, boards[lane]);
+                a_moves[lane] = select_move(rng, boards[lane].a);
+                b_moves[lane] = select_move(rng, boards[lane].b);
+            }
+            simulate_batch(rng, boards, a_moves, b_moves, current_turn, final_turns);
+            rollouts += batch_width;
+        }
+        std::cout << "simulate_batch  " << name << " "
+                  << rollouts / seconds_since(start) << " rollouts/sec" << std::endl;
+    }
+
+    void microseconds_per_parse(const std::string& state_path) {
+        std::string text;
+        read_file(state_path, text);
+        board_t board;
+        uint64_t parses = 0;
+        clock_t::time_point start = clock_t::now();
+        while (clock_t::now() - start < run_time) {
+            std::memset(&board, 0, sizeof(board_t));
+            load_state(board.a, board.b, text.data(), text.data() + text.size());
+            parses++;
+        }
+        std::cout << "load_state      " << 1e6 * seconds_since(start) / parses
+                  << " us/parse" << std::endl;
+        parses = 0;
+        start = clock_t::now();
+        while (clock_t::now() - start < run_time) {
+            std::memset(&board, 0, sizeof(board_t));
+            read_from_state(board.a, board.b, json::parse(text));
+            parses++;
+        }
+        std::cout << "read_from_state " << 1e6 * seconds_since(start) / parses
+                  << " us/parse" << std::endl;
+    }
+
+    template <typename select_t>
+    void selections_per_second(const char* name, uint16_t number_of_choices, select_t select) {
+        std::mt19937 mt(3);
+        alignas(64) uint32_t simulations[272];
+        alignas(64) uint32_t wins[272];
+        uint32_t total_simulations = 0;
+        for (uint16_t i = 0; i < 272; i++) {
+            simulations[i] = 1 + mt() % 5000;
+            wins[i] = mt() % (simulations[i] + 1);
+            total_simulations += simulations[i];
+        }
+        uint64_t selections = 0;
+        uint64_t checksum = 0;
+        clock_t::time_point start = clock_t::now();
+        while (clock_t::now() - start < run_time) {
+            for (uint16_t i = 0; i < 1000; i++) {
+                checksum += select(simulations, wins, number_of_choices, total_simulations + i);
+            }
+            selections += 1000;
+        }
+        std::cout << name << " " << number_of_choices << " children "
+                  << 1e9 * seconds_since(start) / selections << " ns/selection"
+                  << (checksum == 0 ? " " : "") << std::endl;
+    }
+
+    template <typename rng_t>
+    void rollouts_per_second(const char* name, board_t& initial, uint16_t current_turn) {
+        rollouts_per_second_scalar<rng_t>(name, initial, current_turn);
+        rollouts_per_second_batch<rng_t>(name, initial, current_turn);
+    }
+
+    const uint32_t horizon_tree_bytes = 400000000;
+    const uint8_t horizon_seeds = 3;
+
+    // Searches from initial for the given time and returns the root
+    // visits, with the iterations done per second.
+    std::vector<uint32_t> search_visits(search_tree<horizon_tree_bytes>& tree,
+                                        board_t& initial,
+                                        uint16_t current_turn,
+                                        uint16_t horizon,
+                                        uint64_t seed,
+                                        std::chrono::milliseconds time,
+                                        double& iterations_per_second) {
+        xoshiro256ss rng;
+        seed_worker(rng, seed, 0);
+        reset_tree(tree, initial, current_turn);
+        tree.policy.horizon = horizon;
+        std::atomic<bool> stop_search(false);
+        uint64_t iterations = 0;
+        clock_t::time_point start = clock_t::now();
+        while (clock_t::now() - start < time && tree_has_room(*tree.memory)) {
+            iterations += grow_tree(rng, tree, stop_search, 1000);
+        }
+        iterations_per_second = iterations / seconds_since(start);
+        player_node<horizon_tree_bytes> root = root_node(tree);
+        std::vector<uint32_t> simulations(root.number_of_choices, 0);
+        std::vector<uint32_t> wins(root.number_of_choices, 0);
+        uint32_t total_simulations = 0;
+        combine_choices(simulations.data(), wins.data(), *tree.memory, root, total_simulations);
+        return simulations;
+    }
+
+    // The move a search with rollouts cut off at each horizon picks,
+    // against the one a search three times as long with full rollouts
+    // picks, over a few seeds. Close moves make picks differ even between
+    // full searches, so the share of root visits the reference move gets
+    // is shown as well.
+    void decisions_per_horizon(board_t& initial, uint16_t current_turn) {
+        search_tree<horizon_tree_bytes> tree;
+        double iterations_per_second;
+        std::vector<uint32_t> visits = search_visits(tree, initial, current_turn,
+                                                     full_rollout_turns, 0, 3 * run_time,
+                                                     iterations_per_second);
+        uint16_t reference = most_visited(visits.data(), visits.size());
+        for (uint16_t horizon : {full_rollout_turns, (uint16_t)40, (uint16_t)20, (uint16_t)10}) {
+            uint8_t agreed = 0;
+            double total_per_second = 0;
+            double total_share = 0;
+            for (uint8_t seed = 1; seed <= horizon_seeds; seed++) {
+                visits = search_visits(tree, initial, current_turn, horizon, seed, run_time,
+                                       iterations_per_second);
+                agreed += most_visited(visits.data(), visits.size()) == reference;
+                total_per_second += iterations_per_second;
+                total_share += (double)visits[reference]
+                    / std::accumulate(visits.begin(), visits.end(), (uint64_t)0);
+            }
+            std::cout << "horizon " << std::setw(3) << horizon << "     "
+                      << total_per_second / horizon_seeds << " iterations/sec, "
+                      << (int)agreed << "/" << (int)horizon_seeds << " agree with full rollouts, "
+                      << 100 * total_share / horizon_seeds << "% of visits on its move"
+                      << std::endl;
+        }
+    }
+
+}
+
+int main(int argc, char** argv) {
+    std::string state_path(argc > 1 ? argv[1] : "old_state.json");
+    bot::board_t initial;
+    uint16_t current_turn = bot::read_board(initial, state_path);
+    if (current_turn == (uint16_t) -1) {
+        std::cout << "Could not read " << state_path << std::endl;
+        return 1;
+    }
+    bench::microseconds_per_parse(state_path);
+    for (uint16_t number_of_choices : {25, 93, 257}) {
+        bench::selections_per_second("select_uct_scalar", number_of_choices,
+                                     bot::select_uct_scalar);
+        bench::selections_per_second("select_uct       ", number_of_choices, bot::select_uct);
+    }
+    bench::rollouts_per_second<std::mt19937>("mt19937     ", initial, current_turn);
+    bench::rollouts_per_second<bot::xoshiro256ss>("xoshiro256**", initial, current_turn);
+    bench::rollouts_per_second<bot::pcg32>("pcg32       ", initial, current_turn);
+    bench::decisions_per_horizon(initial, current_turn);
+    return 0;
+}
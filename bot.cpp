@@ -1,10 +1,7 @@
 #include "bot.hpp"
 
-int main() {
-    bot::move_and_write_to_file();
+int main(int argc, char** argv) {
+    std::cout << "cpu kernels " << bot::cpu_implementation() << std::endl;
+    bot::move_and_write_to_file(bot::parse_search_options(argc, argv));
     return 0;
 }
-    
-
-
-
@@ -6,12 +6,18 @@
 #include <thread>
 #include <algorithm>
 #include <stdint.h>
+#include <assert.h>
 #include <random>
 #include <atomic>
 #include <chrono>
 #include <iostream>
 #include <fstream>
 #include "json.hpp"
+#include "json_cursor.hpp"
+#include "cpu.hpp"
+#include "options.hpp"
+#include "rng.hpp"
+#include "schedule.hpp"
 
 namespace bot {
 
@@ -43,10 +49,116 @@ namespace bot {
         health_t health;
         bool iron_curtain_available;
         int8_t turns_protected;
+        uint64_t hash;
     };
 
     typedef struct player player_t;
 
+    // Zobrist-style hashing: each field of a player is hashed on its own
+    // and the results are XORed together, so a mutation only pays for
+    // rehashing the field it changed. Buildings, queues, tesla towers,
+    // health and the iron curtain change on events and are kept up to date
+    // in player.hash by set_field and the setters below. Missiles and
+    // energy change on nearly every turn, so they are left out of
+    // player.hash and folded in by board_hash when a position is looked up.
+    enum hash_field_t : uint8_t {
+        energy_buildings_field = 0,
+        attack_buildings_field = 1,
+        defence_buildings_field = 5,
+        attack_building_queue_field = 9,
+        energy_building_queue_field = 10,
+        defence_building_queue_field = 11,
+        player_missiles_field = 15,
+        enemy_half_missiles_field = 19,
+        tesla_towers_field = 23,
+        energy_field = 25,
+        health_field = 26,
+        iron_curtain_available_field = 27,
+        turns_protected_field = 28,
+        hashed_fields = 29
+    };
+
+    // Odd multipliers drawn from splitmix64, one per field.
+    constexpr uint64_t field_hash_multipliers[hashed_fields] = {
+        0x6E3DC8CA1DFD807FULL, 0x3576193313AB3951ULL, 0x85846A2C336AD735ULL,
+        0x70B02F6D24BFF7D9ULL, 0x6F62418BDD0A8AB5ULL, 0x7BC87B00BEFB0741ULL,
+        0x1281CDC7D1FF30DDULL, 0x311C499AA9916675ULL, 0x46CA9B0B66FAC60FULL,
+        0x28A37B18496CBFA9ULL, 0xBC6A91C02A794C41ULL, 0xC600F33811CCD8A1ULL,
+        0x6DB65B147826E779ULL, 0x25099FB888688659ULL, 0x5D8E0B31D2080CBDULL,
+        0xAF9064E017565935ULL, 0x7340E09364197B41ULL, 0xB6604B000E7971CDULL,
+        0x09CF76A789927301ULL, 0x6984458B4B806A65ULL, 0xADB6F93A90F07AB3ULL,
+        0x55945AD0EBE0F1BFULL, 0x16C7DE64ECF4741DULL, 0x02EBDC7E34886073ULL,
+        0xDFECCC711DAF0BE9ULL, 0x01C89CA21A2C2E8FULL, 0xED166973562AD4ABULL,
+        0xE2B16F9C4EBE0045ULL, 0x04B2C3A0FC683A55ULL
+    };
+
+    // A bijection of the value for each field: folding the high half down
+    // first lets the per-field multiplier carry every input bit into the
+    // high bits. Low bits of the product only see the low bits of each
+    // half, which board_hash mixes before the key is used.
+    inline uint64_t field_hash(uint8_t field, uint64_t value) {
+        return (value ^ (value >> 32)) * field_hash_multipliers[field];
+    }
+
+    inline void rehash_field(uint64_t& hash, uint8_t field, uint64_t before, uint64_t after) {
+        hash ^= field_hash(field, before) ^ field_hash(field, after);
+    }
+
+    inline void set_field(uint64_t& hash, uint8_t field, uint64_t& slot, uint64_t value) {
+        rehash_field(hash, field, slot, value);
+        slot = value;
+    }
+
+    inline void set_health(player_t& player, health_t health) {
+        if (player.health != health) {
+            rehash_field(player.hash, health_field, player.health, health);
+            player.health = health;
+        }
+    }
+
+    inline void set_iron_curtain_available(player_t& player, bool available) {
+        if (player.iron_curtain_available != available) {
+            rehash_field(player.hash, iron_curtain_available_field,
+                         player.iron_curtain_available, available);
+            player.iron_curtain_available = available;
+        }
+    }
+
+    inline void set_turns_protected(player_t& player, int8_t turns_protected) {
+        if (player.turns_protected != turns_protected) {
+            rehash_field(player.hash, turns_protected_field,
+                         (uint8_t) player.turns_protected, (uint8_t) turns_protected);
+            player.turns_protected = turns_protected;
+        }
+    }
+
+    // What player.hash should hold, computed from scratch.
+    inline uint64_t hash_player(const player_t& player) {
+        uint64_t hash = field_hash(energy_buildings_field, player.energy_buildings)
+            ^ field_hash(attack_building_queue_field, player.attack_building_queue)
+            ^ field_hash(energy_building_queue_field, player.energy_building_queue)
+            ^ field_hash(tesla_towers_field, player.tesla_towers[0])
+            ^ field_hash(tesla_towers_field + 1, player.tesla_towers[1])
+            ^ field_hash(health_field, player.health)
+            ^ field_hash(iron_curtain_available_field, player.iron_curtain_available)
+            ^ field_hash(turns_protected_field, (uint8_t) player.turns_protected);
+        for (uint8_t i = 0; i < 4; i++) {
+            hash ^= field_hash(attack_buildings_field + i, player.attack_buildings[i])
+                ^ field_hash(defence_buildings_field + i, player.defence_buildings[i])
+                ^ field_hash(defence_building_queue_field + i, player.defence_building_queue[i]);
+        }
+        return hash;
+    }
+
+    inline uint64_t hash_moving_fields(const player_t& player) {
+        uint64_t hash = field_hash(energy_field, player.energy);
+        for (uint8_t i = 0; i < 4; i++) {
+            hash ^= field_hash(player_missiles_field + i, player.player_missiles[i])
+                ^ field_hash(enemy_half_missiles_field + i, player.enemy_half_missiles[i]);
+        }
+        return hash;
+    }
+
     using nlohmann::json;
 
     void read_player_energy_and_health(const json& player_state, player_t& a, player_t& b) {
@@ -68,22 +180,31 @@ namespace bot {
         return (building_positions_t)1 << position_from_row_and_col(row, col);
     }
 
+    // The fields of a building that the bot uses, whichever reader they
+    // came from. type is the first letter of buildingType.
+    struct building_record {
+        char type;
+        uint8_t row;
+        uint8_t col;
+        int16_t construction_time_left;
+        uint8_t weapon_cooldown_time_left;
+        uint8_t health;
+    };
+
     uint64_t* find_where_to_put_building(uint16_t current_turn,
                                          player_t& player,
-                                         const json& building) {
-        std::string building_type = building.at("buildingType").get<std::string>();
-        int16_t construction_time_left = building.at("constructionTimeLeft").get<int16_t>();
-        if (building_type == "TESLA") {
+                                         const building_record& building) {
+        int16_t construction_time_left = building.construction_time_left;
+        if (building.type == 'T') {
             return player.tesla_towers[0] ? &(player.tesla_towers[1]) : player.tesla_towers;
-        } else if (building_type == "ATTACK") {
+        } else if (building.type == 'A') {
             if (construction_time_left > -1) {
                 return &(player.attack_building_queue);
             } else {
-                uint8_t weapon_cooldown_time =
-                    building.at("weaponCooldownTimeLeft").get<uint8_t>();
+                uint8_t weapon_cooldown_time = building.weapon_cooldown_time_left;
                 return &(player.attack_buildings[(current_turn + (weapon_cooldown_time & 3)) & 3]);
             }
-        } else if (building_type == "DEFENSE") {
+        } else if (building.type == 'D') {
             if (construction_time_left > -1) {
                 return &(player.defence_building_queue[((construction_time_left - 3)
                                                         + current_turn) % 3]);
@@ -105,33 +226,42 @@ namespace bot {
         return (weapon_cooldown_time_left << 24) | (position << 16) | construction_time_left;
     }
 
+    void place_building(const building_record& building,
+                        player_t& player,
+                        uint16_t current_turn) {
+        building_positions_t new_building = entity_from_coordinate(building.row, building.col);
+        uint64_t* place_to_put_building =
+            find_where_to_put_building(current_turn, player, building);
+        if (building.construction_time_left < 0 && building.type == 'D') {
+            for (uint8_t i = (4 - (building.health / 5)); i < 4; i++) {
+                place_to_put_building[i] |= new_building;
+            }
+        } else if (building.type == 'T') {
+            uint64_t position = position_from_row_and_col(building.row, building.col);
+            (*place_to_put_building) = make_tesla_tower(building.construction_time_left,
+                                                        building.weapon_cooldown_time_left,
+                                                        position);
+        } else {
+            (*place_to_put_building) |= new_building;
+        }
+    }
+
+    building_record read_building(const json& building) {
+        building_record record;
+        record.type = building.at("buildingType").get<std::string>()[0];
+        record.row = building.at("y").get<int>();
+        record.col = building.at("x").get<int>();
+        record.construction_time_left = building.at("constructionTimeLeft").get<int16_t>();
+        record.weapon_cooldown_time_left = building.at("weaponCooldownTimeLeft").get<uint8_t>();
+        record.health = building.at("health").get<uint8_t>();
+        return record;
+    }
+
     void add_to_player_buildings(std::vector<json>& buildings,
                                  player_t& player,
                                  uint16_t current_turn) {
         for (auto building = buildings.begin(); building != buildings.end(); building++) {
-            json j = *building;
-            uint32_t row = j.at("y").get<int>();
-            uint32_t col = j.at("x").get<int>();
-            building_positions_t new_building = entity_from_coordinate(row, col);
-            uint64_t* place_to_put_building =
-                find_where_to_put_building(current_turn, player, j);
-            int16_t construction_time_left = j.at("constructionTimeLeft").get<int16_t>();
-            std::string building_type = j.at("buildingType").get<std::string>();
-            if (construction_time_left < 0 && building_type == "DEFENSE") {
-                uint8_t health = j.at("health").get<uint8_t>();
-                for (uint8_t i = (4 - (health / 5)); i < 4; i++) {
-                    place_to_put_building[i] |= new_building;
-                }
-            } else if (building_type == "TESLA") {
-                uint64_t position = position_from_row_and_col(row, col);
-                uint64_t weapon_cooldown_time_left =
-                    j.at("weaponCooldownTimeLeft").get<uint64_t>();
-                (*place_to_put_building) = make_tesla_tower(construction_time_left,
-                                                            weapon_cooldown_time_left,
-                                                            position);
-            } else {
-                (*place_to_put_building) |= new_building;
-            }
+            place_building(read_building(*building), player, current_turn);
         }
     }
 
@@ -207,16 +337,20 @@ namespace bot {
     }
 
     inline void collide_tesla_shots(building_positions_t attacked_buildings, player_t& player) {
+        uint64_t hash = player.hash;
         if (attacked_buildings) {
             building_positions_t intersection = attacked_buildings & player.energy_buildings;
-            player.energy_buildings ^= intersection;
+            set_field(hash, energy_buildings_field, player.energy_buildings,
+                      player.energy_buildings ^ intersection);
             for (uint8_t i = 0; i < 4; i++) {
                 intersection = attacked_buildings & player.attack_buildings[i];
-                player.attack_buildings[i] ^= intersection;
+                set_field(hash, attack_buildings_field + i, player.attack_buildings[i],
+                          player.attack_buildings[i] ^ intersection);
             }
             for (uint8_t i = 0; i < 4; i++) {
                 intersection = player.defence_buildings[i] & attacked_buildings;
-                player.defence_buildings[i] ^= intersection;
+                set_field(hash, defence_buildings_field + i, player.defence_buildings[i],
+                          player.defence_buildings[i] ^ intersection);
             }
             uint64_t tesla_tower1 = player.tesla_towers[0];
             intersection = ((building_positions_t)(get_construction_time_left(tesla_tower1) < 0)
@@ -226,19 +360,22 @@ namespace bot {
             intersection = ((building_positions_t)(get_construction_time_left(tesla_tower2) < 0)
                             << get_tesla_tower_position(tesla_tower2)) & attacked_buildings;
             tesla_tower2 &= ((building_positions_t) -(intersection == 0));
-            player.tesla_towers[0] = (-(tesla_tower1 == 0) & tesla_tower2) | tesla_tower1;
-            player.tesla_towers[1] = (-(tesla_tower1 > 0) & tesla_tower2);
+            set_field(hash, tesla_towers_field, player.tesla_towers[0],
+                      (-(tesla_tower1 == 0) & tesla_tower2) | tesla_tower1);
+            set_field(hash, tesla_towers_field + 1, player.tesla_towers[1],
+                      (-(tesla_tower1 > 0) & tesla_tower2));
         }
+        player.hash = hash;
     }
 
     inline void harm_enemy(tesla_tower_t tesla_tower, player_t& player, player_t& enemy) {
         uint8_t col = get_tesla_tower_position(tesla_tower) & 7;
         int16_t construction_time_left = get_construction_time_left(tesla_tower);
         uint8_t weapon_cooldown_time_left = get_weapon_cooldown_time_left(tesla_tower);
-        enemy.health = std::max(0, enemy.health - ((((col < 7) | (construction_time_left > -1)
+        set_health(enemy, std::max(0, enemy.health - ((((col < 7) | (construction_time_left > -1)
                                      | (enemy.turns_protected > 0) |
                                      (weapon_cooldown_time_left > 0) |
-                                     (player.energy < 100)) - 1) & 20));
+                                     (player.energy < 100)) - 1) & 20)));
     }
 
     inline building_positions_t determine_attacked_buildings(player_t& player,
@@ -269,7 +406,8 @@ namespace bot {
         uint8_t weapon_cooldown_time = get_weapon_cooldown_time_left(tesla_tower);
         tesla_tower ^= ((uint64_t)weapon_cooldown_time << 24);
         tesla_tower |= ((uint64_t)min_uint8(weapon_cooldown_time - 1, weapon_cooldown_time) << 24);
-        player.tesla_towers[tesla_index] = tesla_tower;
+        set_field(player.hash, tesla_towers_field + tesla_index,
+                  player.tesla_towers[tesla_index], tesla_tower);
     }
 
     inline void decrement_tesla_tower_construction_time(player_t& player, uint8_t tesla_index) {
@@ -279,7 +417,8 @@ namespace bot {
         uint16_t new_construction_time_left = (((tesla_tower == 0) - 1)
                                                & (construction_time_left - 1));
         tesla_tower |= new_construction_time_left;
-        player.tesla_towers[tesla_index] = tesla_tower;
+        set_field(player.hash, tesla_towers_field + tesla_index,
+                  player.tesla_towers[tesla_index], tesla_tower);
     }
 
     inline uint64_t fire_from_tesla_tower(player_t& player, player_t& enemy, uint8_t tesla_index) {
@@ -298,7 +437,8 @@ namespace bot {
 
         player.energy -= (didnt_fire - 1) & 100;
 
-        player.tesla_towers[tesla_index] |= ((uint64_t)((didnt_fire - 1) & 10) << 24);
+        set_field(player.hash, tesla_towers_field + tesla_index, player.tesla_towers[tesla_index],
+                  player.tesla_towers[tesla_index] | ((uint64_t)((didnt_fire - 1) & 10) << 24));
 
         return attacked_buildings;
     }
@@ -312,14 +452,25 @@ namespace bot {
         return 0;
     }
 
-    uint64_t* get_missile_index(uint8_t col, std::string& player_type, player_t& player) {
-        if (player_type == "A") {
+    uint64_t* get_missile_index(uint8_t col, bool fired_by_a, player_t& player) {
+        if (fired_by_a) {
             return col > 7 ? player.enemy_half_missiles : player.player_missiles;
         } else {
             return col > 7 ? player.player_missiles : player.enemy_half_missiles;
         }
     }
 
+    void place_missile(uint8_t row,
+                       uint8_t col,
+                       bool fired_by_a,
+                       uint8_t missiles_offset,
+                       player_t& a,
+                       player_t& b) {
+        player_t& player = fired_by_a ? a : b;
+        uint64_t* place_to_put_missile = get_missile_index(col, fired_by_a, player);
+        place_to_put_missile[missiles_offset] |= entity_from_coordinate(row, col);
+    }
+
     void add_to_player_missiles(std::vector<json>& missiles,
                                 player_t& a,
                                 player_t& b) {
@@ -327,13 +478,9 @@ namespace bot {
         for (auto missile = missiles.begin(); missile != missiles.end();
              missile++, missiles_offset++) {
             json j = *missile;
-            uint8_t row = j.at("y").get<uint8_t>();
-            uint8_t col = j.at("x").get<uint8_t>();
-            missile_positions_t new_missile = entity_from_coordinate(row, col);
-            std::string player_type = j.at("playerType").get<std::string>();
-            player_t& player = player_type == "A" ? a : b;
-            uint64_t* place_to_put_missile = get_missile_index(col, player_type, player);
-            place_to_put_missile[missiles_offset] |= new_missile;
+            place_missile(j.at("y").get<uint8_t>(), j.at("x").get<uint8_t>(),
+                          j.at("playerType").get<std::string>() == "A",
+                          missiles_offset, a, b);
         }
     }
 
@@ -344,8 +491,10 @@ namespace bot {
             if (get_construction_time_left(tesla_tower_1) >
                 get_construction_time_left(tesla_tower_2)) {
 
-                player.tesla_towers[0] = tesla_tower_2;
-                player.tesla_towers[1] = tesla_tower_1;
+                set_field(player.hash, tesla_towers_field,
+                          player.tesla_towers[0], tesla_tower_2);
+                set_field(player.hash, tesla_towers_field + 1,
+                          player.tesla_towers[1], tesla_tower_1);
             }
         }
     }
@@ -380,9 +529,191 @@ namespace bot {
         for (auto p = players.begin(); p != players.end(); p++) {
             read_player_energy_and_health(*p, a, b);
         }
+        a.hash = hash_player(a);
+        b.hash = hash_player(b);
         return current_turn;
     }
 
+    building_record stream_building(json_cursor& cursor) {
+        building_record record;
+        std::memset(&record, 0, sizeof(building_record));
+        expect(cursor, '{');
+        while (next_member(cursor, '}')) {
+            json_string key = read_key(cursor);
+            if (equals(key, "buildingType")) {
+                json_string type = read_string(cursor);
+                record.type = type.length ? type.begin[0] : 0;
+            } else if (equals(key, "y")) {
+                record.row = read_int(cursor);
+            } else if (equals(key, "x")) {
+                record.col = read_int(cursor);
+            } else if (equals(key, "constructionTimeLeft")) {
+                record.construction_time_left = read_int(cursor);
+            } else if (equals(key, "weaponCooldownTimeLeft")) {
+                record.weapon_cooldown_time_left = read_int(cursor);
+            } else if (equals(key, "health")) {
+                record.health = read_int(cursor);
+            } else {
+                skip_value(cursor);
+            }
+        }
+        return record;
+    }
+
+    void stream_missile(json_cursor& cursor, uint8_t missiles_offset, player_t& a, player_t& b) {
+        uint8_t row = 0;
+        uint8_t col = 0;
+        bool fired_by_a = false;
+        expect(cursor, '{');
+        while (next_member(cursor, '}')) {
+            json_string key = read_key(cursor);
+            if (equals(key, "y")) {
+                row = read_int(cursor);
+            } else if (equals(key, "x")) {
+                col = read_int(cursor);
+            } else if (equals(key, "playerType")) {
+                fired_by_a = equals(read_string(cursor), "A");
+            } else {
+                skip_value(cursor);
+            }
+        }
+        place_missile(row, col, fired_by_a, missiles_offset, a, b);
+    }
+
+    // cellOwner comes after the buildings in the files the game writes, so
+    // the buildings of a cell are held back until the cell is closed.
+    void stream_cell(json_cursor& cursor, player_t& a, player_t& b, uint16_t current_turn) {
+        building_record buildings[4];
+        uint8_t building_count = 0;
+        uint8_t missiles_offset = 0;
+        bool owned_by_a = false;
+        expect(cursor, '{');
+        while (next_member(cursor, '}')) {
+            json_string key = read_key(cursor);
+            if (equals(key, "cellOwner")) {
+                owned_by_a = equals(read_string(cursor), "A");
+            } else if (equals(key, "buildings")) {
+                expect(cursor, '[');
+                while (next_member(cursor, ']')) {
+                    building_record building = stream_building(cursor);
+                    if (building_count < 4) {
+                        buildings[building_count++] = building;
+                    }
+                }
+            } else if (equals(key, "missiles")) {
+                expect(cursor, '[');
+                while (next_member(cursor, ']')) {
+                    stream_missile(cursor, missiles_offset++, a, b);
+                }
+            } else {
+                skip_value(cursor);
+            }
+        }
+        for (uint8_t i = 0; i < building_count; i++) {
+            place_building(buildings[i], owned_by_a ? a : b, current_turn);
+        }
+    }
+
+    void stream_game_map(json_cursor& cursor, player_t& a, player_t& b, uint16_t current_turn) {
+        expect(cursor, '[');
+        while (next_member(cursor, ']')) {
+            expect(cursor, '[');
+            while (next_member(cursor, ']')) {
+                stream_cell(cursor, a, b, current_turn);
+            }
+        }
+        sort_tesla_towers_by_construction_time(a);
+        sort_tesla_towers_by_construction_time(b);
+    }
+
+    void stream_player(json_cursor& cursor, player_t& a, player_t& b) {
+        player_t scratch;
+        player_t* player = &scratch;
+        energy_t energy = 0;
+        health_t health = 0;
+        int8_t turns_protected = 0;
+        bool iron_curtain_available = false;
+        expect(cursor, '{');
+        while (next_member(cursor, '}')) {
+            json_string key = read_key(cursor);
+            if (equals(key, "playerType")) {
+                player = equals(read_string(cursor), "A") ? &a : &b;
+            } else if (equals(key, "energy")) {
+                energy = read_int(cursor);
+            } else if (equals(key, "health")) {
+                health = read_int(cursor);
+            } else if (equals(key, "activeIronCurtainLifetime")) {
+                turns_protected = read_int(cursor) + 1;
+            } else if (equals(key, "ironCurtainAvailable")) {
+                iron_curtain_available = read_bool(cursor);
+            } else {
+                skip_value(cursor);
+            }
+        }
+        player->energy = energy;
+        player->health = health;
+        player->turns_protected = turns_protected;
+        player->iron_curtain_available = iron_curtain_available;
+    }
+
+    // Reads state.json straight into the bitboards, with the same result as
+    // read_from_state but without building a DOM: only the fields the bot
+    // uses are looked at and everything else, teslaHitList and
+    // ironcurtainHitList included, is skipped in place. If gameMap comes
+    // before the round it is skipped at first and read once the round is
+    // known.
+    uint16_t load_state(player_t& a, player_t& b, const char* begin, const char* end) {
+        json_cursor cursor(begin, end);
+        json_cursor game_map(end, end);
+        bool round_known = false;
+        uint16_t current_turn = 0;
+        expect(cursor, '{');
+        while (next_member(cursor, '}')) {
+            json_string key = read_key(cursor);
+            if (equals(key, "gameDetails")) {
+                expect(cursor, '{');
+                while (next_member(cursor, '}')) {
+                    if (equals(read_key(cursor), "round")) {
+                        current_turn = read_int(cursor);
+                        round_known = true;
+                    } else {
+                        skip_value(cursor);
+                    }
+                }
+            } else if (equals(key, "gameMap") && round_known) {
+                stream_game_map(cursor, a, b, current_turn);
+            } else if (equals(key, "gameMap")) {
+                game_map = cursor;
+                skip_value(cursor);
+            } else if (equals(key, "players")) {
+                expect(cursor, '[');
+                while (next_member(cursor, ']')) {
+                    stream_player(cursor, a, b);
+                }
+            } else {
+                skip_value(cursor);
+            }
+        }
+        if (game_map.at != end) {
+            stream_game_map(game_map, a, b, current_turn);
+            cursor.failed |= game_map.failed;
+        }
+        if (cursor.failed || !round_known) {
+            return -1;
+        }
+        a.hash = hash_player(a);
+        b.hash = hash_player(b);
+        return current_turn;
+    }
+
+    uint16_t load_state_file(player_t& a, player_t& b, const std::string& state_path) {
+        std::string contents;
+        if (!read_file(state_path, contents)) {
+            return -1;
+        }
+        return load_state(a, b, contents.data(), contents.data() + contents.size());
+    }
+
     struct board {
         player_t a;
         player_t b;
@@ -390,17 +721,108 @@ namespace bot {
 
     typedef struct board board_t;
 
-    struct game_state {
-        board_t initial;
-        board_t search1;
-        board_t search2;
-        board_t search3;
-        board_t search4;
-        std::atomic<uint32_t> move_scores[768];
-        std::atomic<bool> stop_search;
-    };
+    // The ring buffer slots a field lives in depend on the turn, so the
+    // same position on another turn is a different position. The whole key
+    // goes through the splitmix64 finalizer, since the transposition table
+    // takes its bucket from the low bits.
+    inline uint64_t board_hash(const board_t& board, uint16_t current_turn) {
+        uint64_t state = board.b.hash ^ hash_moving_fields(board.b)
+            ^ ((uint64_t)current_turn << 48);
+        uint64_t key = board.a.hash ^ hash_moving_fields(board.a) ^ splitmix64(state);
+        return splitmix64(key);
+    }
 
-    typedef game_state game_state_t;
+    // Flipping the rows of both halves of the board together changes
+    // nothing about the game while missiles are all there is to it: they
+    // stay in their row. A position and its mirror image then have the same
+    // value with mirrored moves, and are looked up as one through
+    // canonical_board_hash. Row r of a bitboard is byte r, so byte-reversing
+    // it flips the rows.
+    inline uint64_t mirror_rows(uint64_t bits) {
+        return __builtin_bswap64(bits);
+    }
+
+    inline tesla_tower_t mirror_tesla_tower(tesla_tower_t tesla_tower) {
+        return tesla_tower ^ ((uint64_t)(tesla_tower > 0) * 56 << 16);
+    }
+
+    // Doing nothing stays. The iron curtain ignores its position, which
+    // is mirrored with the rest so that every move mirrors back to itself.
+    inline uint16_t mirror_move(uint16_t move) {
+        return move ^ ((uint16_t)((move & 7) > 0) * 56 << 3);
+    }
+
+    inline void mirror_player(const player_t& player, player_t& mirrored) {
+        mirrored = player;
+        mirrored.energy_buildings = mirror_rows(player.energy_buildings);
+        mirrored.attack_building_queue = mirror_rows(player.attack_building_queue);
+        mirrored.energy_building_queue = mirror_rows(player.energy_building_queue);
+        for (uint8_t i = 0; i < 4; i++) {
+            mirrored.attack_buildings[i] = mirror_rows(player.attack_buildings[i]);
+            mirrored.defence_buildings[i] = mirror_rows(player.defence_buildings[i]);
+            mirrored.defence_building_queue[i] = mirror_rows(player.defence_building_queue[i]);
+            mirrored.player_missiles[i] = mirror_rows(player.player_missiles[i]);
+            mirrored.enemy_half_missiles[i] = mirror_rows(player.enemy_half_missiles[i]);
+        }
+        for (uint8_t i = 0; i < 2; i++) {
+            mirrored.tesla_towers[i] = mirror_tesla_tower(player.tesla_towers[i]);
+        }
+        mirrored.hash = hash_player(mirrored);
+    }
+
+    inline void mirror_board(const board_t& board, board_t& mirrored) {
+        mirror_player(board.a, mirrored.a);
+        mirror_player(board.b, mirrored.b);
+    }
+
+    // Compares the fields, in order, with their mirror images until one
+    // differs: negative when the field is smaller, positive when its mirror
+    // image is, and zero when every field is symmetric.
+    inline int8_t compare_with_mirror(const uint64_t* fields, uint8_t count) {
+        for (uint8_t i = 0; i < count; i++) {
+            uint64_t mirrored = mirror_rows(fields[i]);
+            if (fields[i] != mirrored) {
+                return fields[i] < mirrored ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+
+    inline int8_t compare_with_mirror(const player_t& player) {
+        int8_t order = compare_with_mirror(&player.energy_buildings, 1);
+        if (!order) order = compare_with_mirror(player.attack_buildings, 4);
+        if (!order) order = compare_with_mirror(player.defence_buildings, 4);
+        if (!order) order = compare_with_mirror(&player.attack_building_queue, 1);
+        if (!order) order = compare_with_mirror(&player.energy_building_queue, 1);
+        if (!order) order = compare_with_mirror(player.defence_building_queue, 4);
+        if (!order) order = compare_with_mirror(player.player_missiles, 4);
+        if (!order) order = compare_with_mirror(player.enemy_half_missiles, 4);
+        return order;
+    }
+
+    // Of a position and its mirror image, the canonical one is the one
+    // whose fields come first. A symmetric position is its own mirror image
+    // and canonical. determine_attacked_buildings masks each row it hits
+    // by the buildings of the row above, so tesla towers do not play the
+    // same mirrored, and positions with one are always canonical.
+    inline bool is_mirrored(const board_t& board) {
+        if (board.a.tesla_towers[0] | board.b.tesla_towers[0]) {
+            return false;
+        }
+        int8_t order = compare_with_mirror(board.a);
+        return (order ? order : compare_with_mirror(board.b)) > 0;
+    }
+
+    // board_hash of the canonical orientation, the same for a position and
+    // its mirror image.
+    inline uint64_t canonical_board_hash(const board_t& board, uint16_t current_turn) {
+        if (!is_mirrored(board)) {
+            return board_hash(board, current_turn);
+        }
+        board_t mirrored;
+        mirror_board(board, mirrored);
+        return board_hash(mirrored, current_turn);
+    }
 
     const uint64_t max_u_int_64 = 18446744073709551615ULL;
 
@@ -410,48 +832,64 @@ namespace bot {
 
     const uint64_t first_zeros_mask = ~enemy_hits_mask;
 
+    template <bool CurtainActive>
     inline void move_current_missiles(uint8_t offset,
                                       player_t& player,
                                       player_t& enemy) {
         uint64_t player_half_missiles = player.player_missiles[offset];
         player.enemy_half_missiles[offset] =
-            (player_half_missiles & leading_column_mask & -(enemy.turns_protected < 1)) |
+            (player_half_missiles & leading_column_mask
+             & -(!CurtainActive | (enemy.turns_protected < 1))) |
             ((player.enemy_half_missiles[offset] & first_zeros_mask) >> 1);
         player.player_missiles[offset] = first_zeros_mask &
             (player_half_missiles << 1);
     }
 
+    template <bool CurtainActive>
     inline void move_missiles(player_t& a, player_t& b) {
-        move_current_missiles(0, a, b);
-        move_current_missiles(1, a, b);
-        move_current_missiles(2, a, b);
-        move_current_missiles(3, a, b);
-        move_current_missiles(0, b, a);
-        move_current_missiles(1, b, a);
-        move_current_missiles(2, b, a);
-        move_current_missiles(3, b, a);
+        move_current_missiles<CurtainActive>(0, a, b);
+        move_current_missiles<CurtainActive>(1, a, b);
+        move_current_missiles<CurtainActive>(2, a, b);
+        move_current_missiles<CurtainActive>(3, a, b);
+        move_current_missiles<CurtainActive>(0, b, a);
+        move_current_missiles<CurtainActive>(1, b, a);
+        move_current_missiles<CurtainActive>(2, b, a);
+        move_current_missiles<CurtainActive>(3, b, a);
+    }
+
+    inline building_positions_t find_built(player_t& player) {
+        building_positions_t buildings = player.energy_buildings;
+        for (uint8_t i = 0; i < 4; i++) {
+            buildings |= player.attack_buildings[i] | player.defence_buildings[i];
+        }
+        return buildings;
     }
 
-    inline void collide_current_missiles(player_t& player,
-                                         player_t& enemy,
-                                         uint8_t missiles_offset) {
-        building_positions_t enemy_missiles = enemy.enemy_half_missiles[missiles_offset];
+    // Removes the missiles in one ring slot that hit a building of the
+    // player from the slot, and the buildings they hit.
+    template <bool HasTesla>
+    inline void collide_with_buildings(player_t& player, missile_positions_t& missiles) {
+        building_positions_t enemy_missiles = missiles;
+        uint64_t hash = player.hash;
         building_positions_t intersection = enemy_missiles & player.energy_buildings;
-        player.energy_buildings ^= intersection;
+        set_field(hash, energy_buildings_field, player.energy_buildings,
+                  player.energy_buildings ^ intersection);
         enemy_missiles ^= intersection;
         uint64_t enemy_missiles_1 = enemy_missiles;
         for (uint8_t i = 0; i < 4; i++) {
             uint64_t intersection = enemy_missiles_1 & player.attack_buildings[i];
-            player.attack_buildings[i] ^= intersection;
+            set_field(hash, attack_buildings_field + i, player.attack_buildings[i],
+                      player.attack_buildings[i] ^ intersection);
             enemy_missiles_1 ^= intersection;
         }
         uint64_t enemy_missiles_2 = enemy_missiles;
         for (uint8_t i = 0; i < 4; i++) {
             uint64_t intersection = player.defence_buildings[i] & enemy_missiles_2;
-            player.defence_buildings[i] ^= intersection;
+            set_field(hash, defence_buildings_field + i, player.defence_buildings[i],
+                      player.defence_buildings[i] ^ intersection);
             enemy_missiles_2 ^= intersection;
         }
-        if (player.tesla_towers[0]) {
+        if (HasTesla && player.tesla_towers[0]) {
             uint64_t tesla_tower1 = player.tesla_towers[0];
             intersection = ((building_positions_t)(get_construction_time_left(tesla_tower1) < 0)
                             << get_tesla_tower_position(tesla_tower1)) & enemy_missiles;
@@ -462,22 +900,38 @@ namespace bot {
                             << get_tesla_tower_position(tesla_tower2)) & enemy_missiles;
             tesla_tower2 &= ((building_positions_t) -(intersection == 0));
             enemy_missiles ^= intersection;
-            player.tesla_towers[0] = (-(tesla_tower1 == 0) & tesla_tower2) | tesla_tower1;
-            player.tesla_towers[1] = (-(tesla_tower1 > 0) & tesla_tower2);
+            set_field(hash, tesla_towers_field, player.tesla_towers[0],
+                      (-(tesla_tower1 == 0) & tesla_tower2) | tesla_tower1);
+            set_field(hash, tesla_towers_field + 1, player.tesla_towers[1],
+                      (-(tesla_tower1 > 0) & tesla_tower2));
         }
-        enemy.enemy_half_missiles[missiles_offset] &= enemy_missiles & enemy_missiles_1
-            & enemy_missiles_2;
+        missiles &= enemy_missiles & enemy_missiles_1 & enemy_missiles_2;
+        player.hash = hash;
     }
 
+    template <bool HasTesla>
+    inline void collide_current_missiles(player_t& player,
+                                         player_t& enemy,
+                                         uint8_t missiles_offset) {
+        // Most missiles are still in flight, and nothing changes unless one
+        // of them has reached a building.
+        if (((enemy.enemy_half_missiles[missiles_offset] & find_built(player))
+             | (HasTesla ? player.tesla_towers[0] : 0)) == 0) {
+            return;
+        }
+        collide_with_buildings<HasTesla>(player, enemy.enemy_half_missiles[missiles_offset]);
+    }
+
+    template <bool HasTesla>
     inline void collide_missiles(player_t& player, player_t& enemy) {
-        collide_current_missiles(player, enemy, 0);
-        collide_current_missiles(player, enemy, 1);
-        collide_current_missiles(player, enemy, 2);
-        collide_current_missiles(player, enemy, 3);
+        collide_current_missiles<HasTesla>(player, enemy, 0);
+        collide_current_missiles<HasTesla>(player, enemy, 1);
+        collide_current_missiles<HasTesla>(player, enemy, 2);
+        collide_current_missiles<HasTesla>(player, enemy, 3);
     }
 
     inline uint8_t count_set_bits(uint64_t n) {
-        return __builtin_popcount(n) + __builtin_popcount(n >> 32);
+        return __builtin_popcountll(n);
     }
 
     inline uint64_t max_zero(uint64_t a) {
@@ -493,7 +947,7 @@ namespace bot {
                                                  uint8_t offset) {
         uint8_t collision_count = count_set_bits(
              enemy_hits_mask & player.enemy_half_missiles[offset]);
-        enemy.health = std::max(0, (int16_t) enemy.health - (5 * collision_count));
+        set_health(enemy, std::max(0, (int16_t) enemy.health - (5 * collision_count)));
     }
 
     inline void harm_enemy(player_t& player, player_t& enemy) {
@@ -503,7 +957,17 @@ namespace bot {
         harm_enemy_with_current_missiles(player, enemy, 3);
     }
 
+    // The position of the i-th set bit of n from the top, counting from 1.
+    // With BMI2 the i-th set bit from the top is the (count - i)-th from the
+    // bottom, where pdep moves a single set bit to. Callers only ask for i
+    // from 1 to the count; any other i still gives a position on the board.
+    // It is not multiversioned itself: the CPU_CLONES functions that call
+    // it inline the broadword sequence, so no call goes through an ifunc.
     inline uint8_t select_ith_bit(uint64_t n, uint64_t i) {
+#ifdef __BMI2__
+        uint64_t bit = _pdep_u64((uint64_t)1 << ((count_set_bits(n) - i) & 63), n);
+        return 64 - __builtin_ctzll(bit | ((uint64_t)1 << 63));
+#else
         uint64_t a, b, c, d, f = 64;
         uint64_t e;
         a = n - ((n >> 1) & 0x5555555555555555);
@@ -534,6 +998,7 @@ namespace bot {
 
         f -= ((e - i) & 256) >> 8;
         return 65 - f;
+#endif
     }
 
     inline uint16_t select_position(building_positions_t occupied,
@@ -544,17 +1009,22 @@ namespace bot {
     }
 
     inline void queue_attack_building(building_positions_t new_building, player_t& player) {
-        player.attack_building_queue |= new_building;
+        set_field(player.hash, attack_building_queue_field, player.attack_building_queue,
+                  player.attack_building_queue | new_building);
     }
 
     inline void queue_energy_building(building_positions_t new_building, player_t& player) {
-        player.energy_building_queue |= new_building;
+        set_field(player.hash, energy_building_queue_field, player.energy_building_queue,
+                  player.energy_building_queue | new_building);
     }
 
     inline void queue_defence_building(building_positions_t new_building,
                                        player_t& player,
                                        uint16_t current_turn) {
-        player.defence_building_queue[current_turn % 3] |= new_building;
+        uint8_t index = current_turn % 3;
+        set_field(player.hash, defence_building_queue_field + index,
+                  player.defence_building_queue[index],
+                  player.defence_building_queue[index] | new_building);
     }
 
     inline uint8_t mod4(uint16_t n) {
@@ -562,22 +1032,42 @@ namespace bot {
     }
 
     inline void build_attack_building(player_t& player, uint16_t current_turn) {
-        player.attack_buildings[mod4(current_turn)] |= player.attack_building_queue;
-        player.attack_building_queue = 0;
+        if (player.attack_building_queue == 0) {
+            return;
+        }
+        uint64_t hash = player.hash;
+        uint8_t offset = mod4(current_turn);
+        set_field(hash, attack_buildings_field + offset, player.attack_buildings[offset],
+                  player.attack_buildings[offset] | player.attack_building_queue);
+        set_field(hash, attack_building_queue_field, player.attack_building_queue, 0);
+        player.hash = hash;
     }
 
     inline void build_energy_building(player_t& player) {
-        player.energy_buildings |= player.energy_building_queue;
-        player.energy_building_queue = 0;
+        if (player.energy_building_queue == 0) {
+            return;
+        }
+        uint64_t hash = player.hash;
+        set_field(hash, energy_buildings_field, player.energy_buildings,
+                  player.energy_buildings | player.energy_building_queue);
+        set_field(hash, energy_building_queue_field, player.energy_building_queue, 0);
+        player.hash = hash;
     }
 
     inline void build_defence_building(player_t& player, uint8_t current_turn) {
         uint8_t index = current_turn % 3;
         building_positions_t new_building = player.defence_building_queue[index];
+        if (new_building == 0) {
+            return;
+        }
+        uint64_t hash = player.hash;
         for (uint8_t i = 0; i < 4; i++) {
-            player.defence_buildings[i] |= new_building;
+            set_field(hash, defence_buildings_field + i, player.defence_buildings[i],
+                      player.defence_buildings[i] | new_building);
         }
-        player.defence_building_queue[index] = 0;
+        set_field(hash, defence_building_queue_field + index,
+                  player.defence_building_queue[index], 0);
+        player.hash = hash;
     }
 
     inline void fire_missiles(player_t& player, uint16_t current_turn) {
@@ -606,15 +1096,18 @@ namespace bot {
         case 4: {
             tesla_tower_t new_tesla_tower = make_tesla_tower(9, 0, position);
             tesla_tower_t original_tower = player.tesla_towers[0];
-            player.tesla_towers[0] |= -(original_tower == 0) & new_tesla_tower;
-            player.tesla_towers[1] |= -((original_tower > 0) & (player.tesla_towers[1] == 0))
-                & new_tesla_tower;
+            set_field(player.hash, tesla_towers_field, player.tesla_towers[0],
+                      player.tesla_towers[0] | (-(original_tower == 0) & new_tesla_tower));
+            set_field(player.hash, tesla_towers_field + 1, player.tesla_towers[1],
+                      player.tesla_towers[1] |
+                      (-((original_tower > 0) & (player.tesla_towers[1] == 0))
+                       & new_tesla_tower));
             player.energy -= 100;
             break;
         }
         case 5:
-            player.turns_protected = 6;
-            player.iron_curtain_available = false;
+            set_turns_protected(player, 6);
+            set_iron_curtain_available(player, false);
             player.energy -= 100;
             break;
         }
@@ -634,21 +1127,23 @@ namespace bot {
         return (player.energy > 99) && !(player.tesla_towers[1]);
     }
 
-    inline uint16_t select_move(std::mt19937& mt,
-                                player_t& player) {
-        uint64_t occupied = find_occupied(player);
-        uint16_t energy_per_turn = (count_set_bits(player.energy_buildings) * 3) + 5;
+    CPU_CLONES
+    inline uint16_t select_move_with_bits(uint32_t random_bits,
+                                          building_positions_t occupied,
+                                          building_positions_t energy_buildings,
+                                          energy_t energy,
+                                          bool iron_curtain_available) {
+        uint16_t energy_per_turn = (count_set_bits(energy_buildings) * 3) + 5;
         uint16_t position = 0;
-        uint32_t random_bits = mt();
         uint8_t building_num_bits = random_bits >> 8;
         uint8_t position_bits = random_bits & 255;
         uint8_t selection_bits = random_bits >> 16;
-        if (occupied == max_u_int_64 || player.energy < 20) {
+        if (occupied == max_u_int_64 || energy < 20) {
             return 0;
-        } else if (player.energy < 30) {
+        } else if (energy < 30) {
             position = select_position(occupied, position_bits);
             return 3 | (position << 3);
-        } else if (player.energy < 100 || !player.iron_curtain_available) {
+        } else if (energy < 100 || !iron_curtain_available) {
             position = select_position(occupied, random_bits);
             uint8_t building_num = (((building_num_bits & 1) + 2) & -(energy_per_turn < 30))
                 | (2 & -(energy_per_turn > 29));
@@ -660,6 +1155,13 @@ namespace bot {
         }
     }
 
+    template <typename rng_t>
+    inline uint16_t select_move(rng_t& rng,
+                                player_t& player) {
+        return select_move_with_bits(rng(), find_occupied(player), player.energy_buildings,
+                                     player.energy, player.iron_curtain_available);
+    }
+
     inline uint8_t get_position(uint16_t move) {
         return move >> 3;
     }
@@ -688,17 +1190,60 @@ namespace bot {
         build_energy_building(player);
     }
 
+    template <bool HasTesla, bool CurtainActive>
     inline void move_and_collide_missiles(player_t& a, player_t& b) {
         harm_enemy(a, b);
         harm_enemy(b, a);
-        move_missiles(a, b);
-        collide_missiles(a, b);
-        collide_missiles(b, a);
+        move_missiles<CurtainActive>(a, b);
+        collide_missiles<HasTesla>(a, b);
+        collide_missiles<HasTesla>(b, a);
+    }
+
+    const uint64_t second_zeros_mask = first_zeros_mask << 1;
+
+    // Both missile steps of a turn for the missiles one player has fired.
+    // The missiles of the two players never touch the same state, so each
+    // player's can take both steps before the other's. They move two
+    // columns with no stores in between, and only the ring slots with a
+    // missile on a building go through the collisions, in the order two
+    // calls of move_and_collide_missiles take them. Buildings only go away
+    // in collisions, so the ones found up front are enough to tell.
+    template <bool HasTesla, bool CurtainActive>
+    CPU_CLONES
+    inline void move_and_collide_missiles_twice(player_t& player, player_t& enemy) {
+        building_positions_t buildings = HasTesla ? find_constructed(enemy) : find_built(enemy);
+        uint64_t crossing = leading_column_mask & -(!CurtainActive | (enemy.turns_protected < 1));
+        // The base is hit from the first column, one bit a row, so the hits
+        // of all eight slots and steps fit in one word to count.
+        missile_positions_t missiles[4];
+        missile_positions_t hits = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            hits |= (enemy_hits_mask & player.enemy_half_missiles[i]) << i;
+            missiles[i] = (player.player_missiles[i] & crossing)
+                | ((player.enemy_half_missiles[i] & first_zeros_mask) >> 1);
+            if (missiles[i] & buildings) {
+                collide_with_buildings<HasTesla>(enemy, missiles[i]);
+            }
+        }
+        for (uint8_t i = 0; i < 4; i++) {
+            hits |= (enemy_hits_mask & missiles[i]) << (4 + i);
+            missiles[i] = ((player.player_missiles[i] << 1) & crossing)
+                | ((missiles[i] & first_zeros_mask) >> 1);
+            if (missiles[i] & buildings) {
+                collide_with_buildings<HasTesla>(enemy, missiles[i]);
+            }
+            player.enemy_half_missiles[i] = missiles[i];
+            player.player_missiles[i] = first_zeros_mask & second_zeros_mask
+                & (player.player_missiles[i] << 2);
+        }
+        set_health(enemy, std::max(0, (int16_t) enemy.health - (5 * count_set_bits(hits))));
     }
 
     inline void decrement_tesla_towers_construction_time_left(player_t& player) {
-        decrement_tesla_tower_construction_time(player, 0);
-        decrement_tesla_tower_construction_time(player, 1);
+        if (player.tesla_towers[0] | player.tesla_towers[1]) {
+            decrement_tesla_tower_construction_time(player, 0);
+            decrement_tesla_tower_construction_time(player, 1);
+        }
     }
 
     inline void fire_and_collide_tesla_shots(player_t& a, player_t& b) {
@@ -711,83 +1256,817 @@ namespace bot {
     }
 
     inline void decrement_turns_protected(player_t& player) {
-        player.turns_protected -= (player.turns_protected > 0);
+        set_turns_protected(player, player.turns_protected - (player.turns_protected > 0));
     }
 
     inline void set_iron_curtain_availability(player_t& a, 
                                               player_t& b,
                                               uint16_t current_turn) {
-        a.iron_curtain_available |= (current_turn % 30 == 0);
-        b.iron_curtain_available |= (current_turn % 30 == 0);
-    }
-
-    inline void advance_state(uint16_t a_move,
-                              uint16_t b_move,
-                              player_t& a,
-                              player_t& b,
-                              uint16_t current_turn) {
+        set_iron_curtain_available(a, a.iron_curtain_available | (current_turn % 30 == 0));
+        set_iron_curtain_available(b, b.iron_curtain_available | (current_turn % 30 == 0));
+    }
+
+    // One turn of the game for boards in a known phase. Without a tesla
+    // tower on the board, built or queued, none of the tesla steps do
+    // anything, and without an iron curtain up no missile is stopped by
+    // one, so those steps are compiled out. advance_state_in_phase<true,
+    // true> is the whole turn and is right for any board.
+    template <bool HasTesla, bool CurtainActive>
+    CPU_CLONES
+    inline void advance_state_in_phase(uint16_t a_move,
+                                       uint16_t b_move,
+                                       player_t& a,
+                                       player_t& b,
+                                       uint16_t current_turn) {
         set_iron_curtain_availability(a, b, current_turn);
-        decrement_tesla_towers_construction_time_left(a);
-        decrement_tesla_towers_construction_time_left(b);
+        if (HasTesla) {
+            decrement_tesla_towers_construction_time_left(a);
+            decrement_tesla_towers_construction_time_left(b);
+        }
         build_buildings(a, current_turn);
         build_buildings(b, current_turn);
         make_move(a_move, a, current_turn);
         make_move(b_move, b, current_turn);
         fire_missiles(a, current_turn);
         fire_missiles(b, current_turn);
-        fire_and_collide_tesla_shots(a, b);
-        move_and_collide_missiles(a, b);
-        move_and_collide_missiles(a, b);
+        if (HasTesla) {
+            fire_and_collide_tesla_shots(a, b);
+        }
+        move_and_collide_missiles_twice<HasTesla, CurtainActive>(a, b);
+        move_and_collide_missiles_twice<HasTesla, CurtainActive>(b, a);
         increment_energy(a);
         increment_energy(b);
-        decrement_turns_protected(a);
-        decrement_turns_protected(b);
+        if (CurtainActive) {
+            decrement_turns_protected(a);
+            decrement_turns_protected(b);
+        }
+    }
+
+    // Towers and curtains only come from moves, so looking at the board
+    // and the two moves about to be made tells which phase the turn is in.
+    inline void advance_state(uint16_t a_move,
+                              uint16_t b_move,
+                              player_t& a,
+                              player_t& b,
+                              uint16_t current_turn) {
+        bool has_tesla = (a.tesla_towers[0] | a.tesla_towers[1]
+                          | b.tesla_towers[0] | b.tesla_towers[1])
+            || get_building_num(a_move) == 4 || get_building_num(b_move) == 4;
+        bool curtain_active = a.turns_protected > 0 || b.turns_protected > 0
+            || get_building_num(a_move) == 5 || get_building_num(b_move) == 5;
+        if (has_tesla) {
+            if (curtain_active) {
+                advance_state_in_phase<true, true>(a_move, b_move, a, b, current_turn);
+            } else {
+                advance_state_in_phase<true, false>(a_move, b_move, a, b, current_turn);
+            }
+        } else if (curtain_active) {
+            advance_state_in_phase<false, true>(a_move, b_move, a, b, current_turn);
+        } else {
+            advance_state_in_phase<false, false>(a_move, b_move, a, b, current_turn);
+        }
     }
 
-    inline uint32_t simulate(std::mt19937& mt, 
+    // A player is idle when nothing is queued and there are no tesla
+    // towers and no curtain up. Turns in which both players pass keep them
+    // idle, and all that happens in those is missiles being fired and
+    // moving, energy coming in and the curtain coming back.
+    inline bool is_idle(player_t& player) {
+        building_positions_t busy = player.attack_building_queue | player.energy_building_queue
+            | player.tesla_towers[0] | player.tesla_towers[1];
+        for (uint8_t i = 0; i < 3; i++) {
+            busy |= player.defence_building_queue[i];
+        }
+        return busy == 0 && player.turns_protected < 1;
+    }
+
+    inline bool has_missiles(player_t& player) {
+        building_positions_t missiles = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            missiles |= player.attack_buildings[i] | player.player_missiles[i]
+                | player.enemy_half_missiles[i];
+        }
+        return missiles != 0;
+    }
+
+    // Plays turns turns in which neither player moves. Once both players
+    // are idle the turns are cut down to the missiles, which are skipped
+    // too when there are none left to fire, and the energy only counted
+    // again when a collision takes an energy building.
+    CPU_CLONES
+    inline void fast_forward(player_t& a, player_t& b, uint16_t current_turn, uint16_t turns) {
+        uint16_t end_turn = current_turn + turns;
+        while (current_turn != end_turn && !(is_idle(a) && is_idle(b))) {
+            advance_state(0, 0, a, b, current_turn++);
+        }
+        if (current_turn == end_turn) {
+            return;
+        }
+        uint32_t next_curtain = (current_turn + 29) / 30 * 30;
+        bool curtain = next_curtain < (uint32_t) end_turn;
+        set_iron_curtain_available(a, a.iron_curtain_available | curtain);
+        set_iron_curtain_available(b, b.iron_curtain_available | curtain);
+        if (!has_missiles(a) && !has_missiles(b)) {
+            turns = end_turn - current_turn;
+            a.energy += turns * ((count_set_bits(a.energy_buildings) * 3) + 5);
+            b.energy += turns * ((count_set_bits(b.energy_buildings) * 3) + 5);
+            return;
+        }
+        building_positions_t a_energy_buildings = a.energy_buildings;
+        building_positions_t b_energy_buildings = b.energy_buildings;
+        energy_t a_income = (count_set_bits(a_energy_buildings) * 3) + 5;
+        energy_t b_income = (count_set_bits(b_energy_buildings) * 3) + 5;
+        for (; current_turn != end_turn; current_turn++) {
+            fire_missiles(a, current_turn);
+            fire_missiles(b, current_turn);
+            move_and_collide_missiles_twice<false, false>(a, b);
+            move_and_collide_missiles_twice<false, false>(b, a);
+            if (a.energy_buildings != a_energy_buildings) {
+                a_energy_buildings = a.energy_buildings;
+                a_income = (count_set_bits(a_energy_buildings) * 3) + 5;
+            }
+            if (b.energy_buildings != b_energy_buildings) {
+                b_energy_buildings = b.energy_buildings;
+                b_income = (count_set_bits(b_energy_buildings) * 3) + 5;
+            }
+            a.energy += a_income;
+            b.energy += b_income;
+        }
+    }
+
+    template <typename rng_t>
+    inline uint32_t simulate(rng_t& rng,
                              player_t& a,
                              player_t& b,
                              uint16_t initial_a_move,
                              uint16_t initial_b_move,
-                             uint16_t current_turn) {
+                             uint16_t current_turn,
+                             uint16_t horizon = full_rollout_turns) {
         uint16_t initial_turn = current_turn;
         advance_state(initial_a_move, initial_b_move, a, b, current_turn);
         current_turn++;
-        while (a.health > 0 && b.health > 0 && current_turn < initial_turn + 120) {
-            uint16_t a_move = select_move(mt, a);
-            uint16_t b_move = select_move(mt, b);
-            advance_state(a_move, b_move, a, b, current_turn);
+        while (a.health > 0 && b.health > 0 && current_turn < initial_turn + horizon) {
+            uint16_t a_move = select_move(rng, a);
+            uint16_t b_move = select_move(rng, b);
+            if ((a_move | b_move) == 0) {
+                fast_forward(a, b, current_turn, 1);
+            } else {
+                advance_state(a_move, b_move, a, b, current_turn);
+            }
             current_turn++;
         }
         return current_turn;
     }
 
-    inline void mc_search(board_t& initial, board_t& search_board,
-                          std::atomic<uint32_t>* move_scores,
+    // Lanes are passed by reference: the calling convention for 32-byte
+    // vectors differs between targets with and without AVX.
+
+    typedef uint64_t lanes_t __attribute__((vector_size(32)));
+    typedef int64_t signed_lanes_t __attribute__((vector_size(32)));
+
+    const uint8_t batch_width = 4;
+
+    const lanes_t no_lanes = {0, 0, 0, 0};
+    const lanes_t one_lanes = {1, 1, 1, 1};
+
+    struct player_batch {
+        lanes_t energy_buildings;
+        lanes_t attack_buildings[4];
+        lanes_t defence_buildings[4];
+        lanes_t attack_building_queue;
+        lanes_t energy_building_queue;
+        lanes_t defence_building_queue[4];
+        lanes_t player_missiles[4];
+        lanes_t enemy_half_missiles[4];
+        lanes_t tesla_towers[2];
+        signed_lanes_t energy;
+        signed_lanes_t health;
+        signed_lanes_t iron_curtain_available;
+        signed_lanes_t turns_protected;
+    };
+
+    typedef struct player_batch player_batch_t;
+
+    struct board_batch {
+        player_batch_t a;
+        player_batch_t b;
+    };
+
+    typedef struct board_batch board_batch_t;
+
+    inline void load_player_lane(player_batch_t& batch, uint8_t lane, const player_t& player) {
+        batch.energy_buildings[lane] = player.energy_buildings;
+        for (uint8_t i = 0; i < 4; i++) {
+            batch.attack_buildings[i][lane] = player.attack_buildings[i];
+            batch.defence_buildings[i][lane] = player.defence_buildings[i];
+            batch.defence_building_queue[i][lane] = player.defence_building_queue[i];
+            batch.player_missiles[i][lane] = player.player_missiles[i];
+            batch.enemy_half_missiles[i][lane] = player.enemy_half_missiles[i];
+        }
+        batch.attack_building_queue[lane] = player.attack_building_queue;
+        batch.energy_building_queue[lane] = player.energy_building_queue;
+        batch.tesla_towers[0][lane] = player.tesla_towers[0];
+        batch.tesla_towers[1][lane] = player.tesla_towers[1];
+        batch.energy[lane] = player.energy;
+        batch.health[lane] = player.health;
+        batch.iron_curtain_available[lane] = player.iron_curtain_available;
+        batch.turns_protected[lane] = player.turns_protected;
+    }
+
+    inline void store_player_lane(const player_batch_t& batch, uint8_t lane, player_t& player) {
+        player.energy_buildings = batch.energy_buildings[lane];
+        for (uint8_t i = 0; i < 4; i++) {
+            player.attack_buildings[i] = batch.attack_buildings[i][lane];
+            player.defence_buildings[i] = batch.defence_buildings[i][lane];
+            player.defence_building_queue[i] = batch.defence_building_queue[i][lane];
+            player.player_missiles[i] = batch.player_missiles[i][lane];
+            player.enemy_half_missiles[i] = batch.enemy_half_missiles[i][lane];
+        }
+        player.attack_building_queue = batch.attack_building_queue[lane];
+        player.energy_building_queue = batch.energy_building_queue[lane];
+        player.tesla_towers[0] = batch.tesla_towers[0][lane];
+        player.tesla_towers[1] = batch.tesla_towers[1][lane];
+        player.energy = batch.energy[lane];
+        player.health = batch.health[lane];
+        player.iron_curtain_available = batch.iron_curtain_available[lane];
+        player.turns_protected = batch.turns_protected[lane];
+        player.hash = hash_player(player);
+    }
+
+    inline void load_board_lane(board_batch_t& batch, uint8_t lane, const board_t& board) {
+        load_player_lane(batch.a, lane, board.a);
+        load_player_lane(batch.b, lane, board.b);
+    }
+
+    inline void store_board_lane(const board_batch_t& batch, uint8_t lane, board_t& board) {
+        store_player_lane(batch.a, lane, board.a);
+        store_player_lane(batch.b, lane, board.b);
+    }
+
+    inline void count_set_bits_batch(const lanes_t& bits, lanes_t& count) {
+        lanes_t n = bits - ((bits >> 1) & 0x5555555555555555ULL);
+        n = (n & 0x3333333333333333ULL) + ((n >> 2) & 0x3333333333333333ULL);
+        n = (n + (n >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        n += n >> 8;
+        n += n >> 16;
+        n += n >> 32;
+        count = n & 127;
+    }
+
+    // Sums bytes whose totals are known to stay below 256, which is all
+    // that is needed for the hits on the first column of each row.
+    inline void sum_bytes_batch(const lanes_t& bytes, lanes_t& sum) {
+        lanes_t n = bytes + (bytes >> 32);
+        n += n >> 16;
+        n += n >> 8;
+        sum = n & 255;
+    }
+
+    inline void find_occupied_batch(const player_batch_t& player, lanes_t& occupied) {
+        occupied = player.energy_buildings
+            | player.energy_building_queue
+            | player.attack_building_queue;
+        for (uint8_t i = 0; i < 4; i++) {
+            occupied |= player.attack_buildings[i]
+                | player.defence_buildings[i]
+                | player.defence_building_queue[i];
+        }
+        for (uint8_t i = 0; i < 2; i++) {
+            lanes_t tesla_tower = player.tesla_towers[i];
+            occupied |= ((lanes_t)(tesla_tower != 0) & 1) << ((tesla_tower >> 16) & 63);
+        }
+    }
+
+    inline void set_iron_curtain_availability_batch(board_batch_t& batch,
+                                                    uint16_t current_turn) {
+        int64_t available = (current_turn % 30 == 0);
+        batch.a.iron_curtain_available |= available;
+        batch.b.iron_curtain_available |= available;
+    }
+
+    inline void decrement_tesla_towers_construction_time_left_batch(player_batch_t& player) {
+        for (uint8_t i = 0; i < 2; i++) {
+            lanes_t construction_time_left = player.tesla_towers[i] & 65535;
+            lanes_t tesla_tower = player.tesla_towers[i] ^ construction_time_left;
+            player.tesla_towers[i] = tesla_tower |
+                ((lanes_t)(tesla_tower != 0) & ((construction_time_left - 1) & 65535));
+        }
+    }
+
+    inline void build_buildings_batch(player_batch_t& player, uint16_t current_turn) {
+        player.attack_buildings[mod4(current_turn)] |= player.attack_building_queue;
+        player.attack_building_queue = no_lanes;
+        uint8_t index = (uint8_t) current_turn % 3;
+        lanes_t new_building = player.defence_building_queue[index];
+        for (uint8_t i = 0; i < 4; i++) {
+            player.defence_buildings[i] |= new_building;
+        }
+        player.defence_building_queue[index] = no_lanes;
+        player.energy_buildings |= player.energy_building_queue;
+        player.energy_building_queue = no_lanes;
+    }
+
+    inline void make_move_batch(const lanes_t& moves,
+                                player_batch_t& player,
+                                uint16_t current_turn) {
+        lanes_t building_num = moves & 7;
+        lanes_t position = moves >> 3;
+        lanes_t new_building = one_lanes << position;
+        lanes_t is_defence = (lanes_t)(building_num == 1);
+        lanes_t is_attack = (lanes_t)(building_num == 2);
+        lanes_t is_energy = (lanes_t)(building_num == 3);
+        lanes_t is_tesla = (lanes_t)(building_num == 4);
+        lanes_t is_iron_curtain = (lanes_t)(building_num == 5);
+        player.defence_building_queue[(uint8_t) current_turn % 3] |= new_building & is_defence;
+        player.attack_building_queue |= new_building & is_attack;
+        player.energy_building_queue |= new_building & is_energy;
+        lanes_t new_tesla_tower = ((position << 16) | 9) & is_tesla;
+        lanes_t original_tower = player.tesla_towers[0];
+        player.tesla_towers[0] |= (lanes_t)(original_tower == 0) & new_tesla_tower;
+        player.tesla_towers[1] |= (lanes_t)((original_tower != 0)
+                                            & (player.tesla_towers[1] == 0)) & new_tesla_tower;
+        signed_lanes_t iron_curtain = (signed_lanes_t) is_iron_curtain;
+        player.turns_protected = (iron_curtain & 6) | (~iron_curtain & player.turns_protected);
+        player.iron_curtain_available &= ~iron_curtain;
+        player.energy -= (signed_lanes_t)(((is_defence | is_attack) & 30) | (is_energy & 20)
+                                          | ((is_tesla | is_iron_curtain) & 100));
+    }
+
+    inline void fire_missiles_batch(player_batch_t& player, uint16_t current_turn) {
+        uint8_t offset = mod4(current_turn);
+        player.player_missiles[offset] |= player.attack_buildings[offset];
+    }
+
+    // Tesla towers are rare in rollouts, so lanes that have one are
+    // stepped through the scalar code instead of vectorising the targeting.
+    inline void fire_and_collide_tesla_shots_batch(board_batch_t& batch) {
+        lanes_t has_tesla = batch.a.tesla_towers[0] | batch.b.tesla_towers[0];
+        for (uint8_t lane = 0; lane < batch_width; lane++) {
+            if (has_tesla[lane]) {
+                board_t board;
+                store_board_lane(batch, lane, board);
+                fire_and_collide_tesla_shots(board.a, board.b);
+                load_board_lane(batch, lane, board);
+            }
+        }
+    }
+
+    inline void harm_enemy_batch(player_batch_t& player, player_batch_t& enemy) {
+        lanes_t hits = (player.enemy_half_missiles[0] & enemy_hits_mask)
+            + (player.enemy_half_missiles[1] & enemy_hits_mask)
+            + (player.enemy_half_missiles[2] & enemy_hits_mask)
+            + (player.enemy_half_missiles[3] & enemy_hits_mask);
+        lanes_t hit_count;
+        sum_bytes_batch(hits, hit_count);
+        signed_lanes_t health = enemy.health - (signed_lanes_t)(5 * hit_count);
+        enemy.health = health & (signed_lanes_t)(health > 0);
+    }
+
+    inline void move_missiles_batch(player_batch_t& player, player_batch_t& enemy) {
+        lanes_t unprotected = (lanes_t)(enemy.turns_protected < 1);
+        for (uint8_t offset = 0; offset < 4; offset++) {
+            lanes_t player_half_missiles = player.player_missiles[offset];
+            player.enemy_half_missiles[offset] =
+                (player_half_missiles & leading_column_mask & unprotected) |
+                ((player.enemy_half_missiles[offset] & first_zeros_mask) >> 1);
+            player.player_missiles[offset] = first_zeros_mask & (player_half_missiles << 1);
+        }
+    }
+
+    inline void constructed_tesla_tower_batch(const lanes_t& tesla_tower, lanes_t& tower) {
+        tower = ((tesla_tower >> 15) & 1) << ((tesla_tower >> 16) & 63);
+    }
+
+    CPU_CLONES
+    inline void collide_current_missiles_batch(player_batch_t& player,
+                                               player_batch_t& enemy,
+                                               uint8_t missiles_offset) {
+        lanes_t enemy_missiles = enemy.enemy_half_missiles[missiles_offset];
+        lanes_t intersection = enemy_missiles & player.energy_buildings;
+        player.energy_buildings ^= intersection;
+        enemy_missiles ^= intersection;
+        lanes_t enemy_missiles_1 = enemy_missiles;
+        for (uint8_t i = 0; i < 4; i++) {
+            lanes_t intersection = enemy_missiles_1 & player.attack_buildings[i];
+            player.attack_buildings[i] ^= intersection;
+            enemy_missiles_1 ^= intersection;
+        }
+        lanes_t enemy_missiles_2 = enemy_missiles;
+        for (uint8_t i = 0; i < 4; i++) {
+            lanes_t intersection = player.defence_buildings[i] & enemy_missiles_2;
+            player.defence_buildings[i] ^= intersection;
+            enemy_missiles_2 ^= intersection;
+        }
+        lanes_t has_tesla = (lanes_t)(player.tesla_towers[0] != 0);
+        lanes_t tesla_tower1 = player.tesla_towers[0];
+        lanes_t constructed;
+        constructed_tesla_tower_batch(tesla_tower1, constructed);
+        intersection = constructed & enemy_missiles & has_tesla;
+        tesla_tower1 &= (lanes_t)(intersection == 0);
+        enemy_missiles ^= intersection;
+        lanes_t tesla_tower2 = player.tesla_towers[1];
+        constructed_tesla_tower_batch(tesla_tower2, constructed);
+        intersection = constructed & enemy_missiles & has_tesla;
+        tesla_tower2 &= (lanes_t)(intersection == 0);
+        enemy_missiles ^= intersection;
+        player.tesla_towers[0] = (has_tesla & (((lanes_t)(tesla_tower1 == 0) & tesla_tower2)
+                                               | tesla_tower1))
+            | (~has_tesla & player.tesla_towers[0]);
+        player.tesla_towers[1] = (has_tesla & (lanes_t)(tesla_tower1 != 0) & tesla_tower2)
+            | (~has_tesla & player.tesla_towers[1]);
+        enemy.enemy_half_missiles[missiles_offset] &= enemy_missiles & enemy_missiles_1
+            & enemy_missiles_2;
+    }
+
+    inline void collide_missiles_batch(player_batch_t& player, player_batch_t& enemy) {
+        collide_current_missiles_batch(player, enemy, 0);
+        collide_current_missiles_batch(player, enemy, 1);
+        collide_current_missiles_batch(player, enemy, 2);
+        collide_current_missiles_batch(player, enemy, 3);
+    }
+
+    CPU_CLONES
+    inline void move_and_collide_missiles_batch(board_batch_t& batch) {
+        harm_enemy_batch(batch.a, batch.b);
+        harm_enemy_batch(batch.b, batch.a);
+        move_missiles_batch(batch.a, batch.b);
+        move_missiles_batch(batch.b, batch.a);
+        collide_missiles_batch(batch.a, batch.b);
+        collide_missiles_batch(batch.b, batch.a);
+    }
+
+    inline void increment_energy_batch(player_batch_t& player) {
+        lanes_t energy_buildings;
+        count_set_bits_batch(player.energy_buildings, energy_buildings);
+        player.energy += (signed_lanes_t)((energy_buildings * 3) + 5);
+    }
+
+    inline void decrement_turns_protected_batch(player_batch_t& player) {
+        player.turns_protected += (signed_lanes_t)(player.turns_protected > 0);
+    }
+
+    // Steps batch_width independent boards through one turn in lockstep.
+    // Every lane must be on current_turn so the ring buffer offsets agree.
+    inline void advance_state_batch(const lanes_t& a_moves,
+                                    const lanes_t& b_moves,
+                                    board_batch_t& batch,
+                                    uint16_t current_turn) {
+        set_iron_curtain_availability_batch(batch, current_turn);
+        decrement_tesla_towers_construction_time_left_batch(batch.a);
+        decrement_tesla_towers_construction_time_left_batch(batch.b);
+        build_buildings_batch(batch.a, current_turn);
+        build_buildings_batch(batch.b, current_turn);
+        make_move_batch(a_moves, batch.a, current_turn);
+        make_move_batch(b_moves, batch.b, current_turn);
+        fire_missiles_batch(batch.a, current_turn);
+        fire_missiles_batch(batch.b, current_turn);
+        fire_and_collide_tesla_shots_batch(batch);
+        move_and_collide_missiles_batch(batch);
+        move_and_collide_missiles_batch(batch);
+        increment_energy_batch(batch.a);
+        increment_energy_batch(batch.b);
+        decrement_turns_protected_batch(batch.a);
+        decrement_turns_protected_batch(batch.b);
+    }
+
+    inline bool any_lane(const lanes_t& mask) {
+        return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+    }
+
+    const uint8_t lanes_per_player = sizeof(player_batch_t) / sizeof(lanes_t);
+
+    inline void select_lanes(const lanes_t& mask, const board_batch_t& from, board_batch_t& into) {
+        const lanes_t* source = reinterpret_cast<const lanes_t*>(&from);
+        lanes_t* destination = reinterpret_cast<lanes_t*>(&into);
+        for (uint8_t i = 0; i < 2 * lanes_per_player; i++) {
+            destination[i] = (mask & source[i]) | (~mask & destination[i]);
+        }
+    }
+
+    // Plays batch_width random rollouts at once. A lane is copied back into
+    // batch as soon as its game ends, so batch finishes holding the same
+    // boards and final_turns the same turns that simulate would produce.
+    template <typename rng_t>
+    inline void simulate_batch(rng_t& rng,
+                               board_batch_t& batch,
+                               const lanes_t& initial_a_moves,
+                               const lanes_t& initial_b_moves,
+                               uint16_t current_turn,
+                               lanes_t& final_turns) {
+        board_batch_t running_batch = batch;
+        uint16_t initial_turn = current_turn;
+        advance_state_batch(initial_a_moves, initial_b_moves, running_batch, current_turn);
+        current_turn++;
+        lanes_t running = ~no_lanes;
+        lanes_t a_moves, b_moves;
+        while (true) {
+            int64_t out_of_turns = -(int64_t)(current_turn >= initial_turn + full_rollout_turns);
+            lanes_t finished = running &
+                (lanes_t)((running_batch.a.health < 1) | (running_batch.b.health < 1)
+                          | out_of_turns);
+            if (any_lane(finished)) {
+                select_lanes(finished, running_batch, batch);
+                final_turns = (finished & current_turn) | (~finished & final_turns);
+                running &= ~finished;
+                if (!any_lane(running)) {
+                    return;
+                }
+            }
+            lanes_t a_occupied, b_occupied;
+            find_occupied_batch(running_batch.a, a_occupied);
+            find_occupied_batch(running_batch.b, b_occupied);
+            uint32_t random_bits[2 * batch_width];
+            fill_random_bits(rng, random_bits, 2 * batch_width);
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                if (running[lane]) {
+                    a_moves[lane] = select_move_with_bits(
+                        random_bits[2 * lane], a_occupied[lane],
+                        running_batch.a.energy_buildings[lane],
+                        running_batch.a.energy[lane],
+                        running_batch.a.iron_curtain_available[lane]);
+                    b_moves[lane] = select_move_with_bits(
+                        random_bits[2 * lane + 1], b_occupied[lane],
+                        running_batch.b.energy_buildings[lane],
+                        running_batch.b.energy[lane],
+                        running_batch.b.iron_curtain_available[lane]);
+                } else {
+                    a_moves[lane] = 0;
+                    b_moves[lane] = 0;
+                }
+            }
+            advance_state_batch(a_moves, b_moves, running_batch, current_turn);
+            current_turn++;
+        }
+    }
+
+    template <typename rng_t>
+    inline void simulate_batch(rng_t& rng,
+                               board_t* boards,
+                               const uint16_t* initial_a_moves,
+                               const uint16_t* initial_b_moves,
+                               uint16_t current_turn,
+                               uint32_t* final_turns) {
+        board_batch_t batch;
+        lanes_t a_moves, b_moves, final_turn_lanes;
+        for (uint8_t lane = 0; lane < batch_width; lane++) {
+            load_board_lane(batch, lane, boards[lane]);
+            a_moves[lane] = initial_a_moves[lane];
+            b_moves[lane] = initial_b_moves[lane];
+        }
+        simulate_batch(rng, batch, a_moves, b_moves, current_turn, final_turn_lanes);
+        for (uint8_t lane = 0; lane < batch_width; lane++) {
+            store_board_lane(batch, lane, boards[lane]);
+            final_turns[lane] = final_turn_lanes[lane];
+        }
+    }
+
+    // Each field of a player is a contiguous column across the N boards of
+    // a pool, in the same order as player_batch, so the batch_width slots of
+    // a block load straight into one lanes_t. Blocks start a cache line
+    // apart so workers renting neighbouring blocks never share a line.
+    const uint8_t pool_block_stride = 64 / sizeof(uint64_t);
+
+    inline uint16_t block_slot(uint16_t block, uint8_t lane) {
+        return block * pool_block_stride + lane;
+    }
+
+    template <uint16_t N>
+    struct player_columns {
+        uint64_t energy_buildings[N];
+        uint64_t attack_buildings[4][N];
+        uint64_t defence_buildings[4][N];
+        uint64_t attack_building_queue[N];
+        uint64_t energy_building_queue[N];
+        uint64_t defence_building_queue[4][N];
+        uint64_t player_missiles[4][N];
+        uint64_t enemy_half_missiles[4][N];
+        uint64_t tesla_towers[2][N];
+        int64_t energy[N];
+        int64_t health[N];
+        int64_t iron_curtain_available[N];
+        int64_t turns_protected[N];
+    };
+
+    template <uint16_t N>
+    struct alignas(64) board_pool {
+        static_assert(N % pool_block_stride == 0 && N / pool_block_stride <= 64,
+                      "a board pool holds up to 64 whole blocks");
+        player_columns<N> a;
+        player_columns<N> b;
+        std::atomic<uint64_t> free_blocks;
+
+        board_pool() : free_blocks(all_blocks()) {
+        }
+
+        static uint64_t all_blocks() {
+            return (N / pool_block_stride) == 64 ? max_u_int_64 :
+                ((uint64_t)1 << (N / pool_block_stride)) - 1;
+        }
+    };
+
+    template <uint16_t N>
+    void clear_pool(board_pool<N>& pool) {
+        std::memset(&pool.a, 0, sizeof(pool.a));
+        std::memset(&pool.b, 0, sizeof(pool.b));
+        pool.free_blocks.store(board_pool<N>::all_blocks());
+    }
+
+    // Hands out a block of batch_width boards, or (uint16_t)-1 when every
+    // block is rented.
+    template <uint16_t N>
+    uint16_t rent_block(board_pool<N>& pool) {
+        uint64_t free_blocks = pool.free_blocks.load();
+        while (free_blocks) {
+            uint64_t rest = free_blocks & (free_blocks - 1);
+            if (pool.free_blocks.compare_exchange_weak(free_blocks, rest)) {
+                return __builtin_ctzll(free_blocks ^ rest);
+            }
+        }
+        return (uint16_t) -1;
+    }
+
+    template <uint16_t N>
+    void return_block(board_pool<N>& pool, uint16_t block) {
+        pool.free_blocks.fetch_or((uint64_t)1 << block);
+    }
+
+    template <uint16_t N>
+    inline void scatter_player(const player_t& player, player_columns<N>& columns, uint16_t slot) {
+        columns.energy_buildings[slot] = player.energy_buildings;
+        for (uint8_t i = 0; i < 4; i++) {
+            columns.attack_buildings[i][slot] = player.attack_buildings[i];
+            columns.defence_buildings[i][slot] = player.defence_buildings[i];
+            columns.defence_building_queue[i][slot] = player.defence_building_queue[i];
+            columns.player_missiles[i][slot] = player.player_missiles[i];
+            columns.enemy_half_missiles[i][slot] = player.enemy_half_missiles[i];
+        }
+        columns.attack_building_queue[slot] = player.attack_building_queue;
+        columns.energy_building_queue[slot] = player.energy_building_queue;
+        columns.tesla_towers[0][slot] = player.tesla_towers[0];
+        columns.tesla_towers[1][slot] = player.tesla_towers[1];
+        columns.energy[slot] = player.energy;
+        columns.health[slot] = player.health;
+        columns.iron_curtain_available[slot] = player.iron_curtain_available;
+        columns.turns_protected[slot] = player.turns_protected;
+    }
+
+    template <uint16_t N>
+    inline void gather_player(const player_columns<N>& columns, uint16_t slot, player_t& player) {
+        player.energy_buildings = columns.energy_buildings[slot];
+        for (uint8_t i = 0; i < 4; i++) {
+            player.attack_buildings[i] = columns.attack_buildings[i][slot];
+            player.defence_buildings[i] = columns.defence_buildings[i][slot];
+            player.defence_building_queue[i] = columns.defence_building_queue[i][slot];
+            player.player_missiles[i] = columns.player_missiles[i][slot];
+            player.enemy_half_missiles[i] = columns.enemy_half_missiles[i][slot];
+        }
+        player.attack_building_queue = columns.attack_building_queue[slot];
+        player.energy_building_queue = columns.energy_building_queue[slot];
+        player.tesla_towers[0] = columns.tesla_towers[0][slot];
+        player.tesla_towers[1] = columns.tesla_towers[1][slot];
+        player.energy = columns.energy[slot];
+        player.health = columns.health[slot];
+        player.iron_curtain_available = columns.iron_curtain_available[slot];
+        player.turns_protected = columns.turns_protected[slot];
+        player.hash = hash_player(player);
+    }
+
+    template <uint16_t N>
+    inline void scatter_board(const board_t& board, board_pool<N>& pool, uint16_t slot) {
+        scatter_player(board.a, pool.a, slot);
+        scatter_player(board.b, pool.b, slot);
+    }
+
+    template <uint16_t N>
+    inline void gather_board(const board_pool<N>& pool, uint16_t slot, board_t& board) {
+        gather_player(pool.a, slot, board.a);
+        gather_player(pool.b, slot, board.b);
+    }
+
+    template <uint16_t N>
+    inline void load_player_block(const player_columns<N>& columns, uint16_t block,
+                                  player_batch_t& batch) {
+        const uint64_t* column = reinterpret_cast<const uint64_t*>(&columns);
+        lanes_t* lanes = reinterpret_cast<lanes_t*>(&batch);
+        for (uint8_t i = 0; i < lanes_per_player; i++, column += N) {
+            std::memcpy(lanes + i, column + block_slot(block, 0), sizeof(lanes_t));
+        }
+    }
+
+    template <uint16_t N>
+    inline void store_player_block(const player_batch_t& batch, player_columns<N>& columns,
+                                   uint16_t block) {
+        uint64_t* column = reinterpret_cast<uint64_t*>(&columns);
+        const lanes_t* lanes = reinterpret_cast<const lanes_t*>(&batch);
+        for (uint8_t i = 0; i < lanes_per_player; i++, column += N) {
+            std::memcpy(column + block_slot(block, 0), lanes + i, sizeof(lanes_t));
+        }
+    }
+
+    template <uint16_t N>
+    inline void load_block(const board_pool<N>& pool, uint16_t block, board_batch_t& batch) {
+        load_player_block(pool.a, block, batch.a);
+        load_player_block(pool.b, block, batch.b);
+    }
+
+    template <uint16_t N>
+    inline void store_block(const board_batch_t& batch, board_pool<N>& pool, uint16_t block) {
+        store_player_block(batch.a, pool.a, block);
+        store_player_block(batch.b, pool.b, block);
+    }
+
+    template <uint16_t N, typename rng_t>
+    inline void simulate_batch(rng_t& rng,
+                               board_pool<N>& pool,
+                               uint16_t block,
+                               const lanes_t& a_moves,
+                               const lanes_t& b_moves,
+                               uint16_t current_turn,
+                               lanes_t& final_turns) {
+        board_batch_t batch;
+        load_block(pool, block, batch);
+        simulate_batch(rng, batch, a_moves, b_moves, current_turn, final_turns);
+        store_block(batch, pool, block);
+    }
+
+    typedef board_pool<max_search_threads * pool_block_stride> search_pool_t;
+
+    // Written only by the worker that owns it and merged after the workers
+    // join, so the rollout loop never touches a shared cache line.
+    struct alignas(64) search_shard {
+        uint32_t move_scores[768];
+        uint64_t sim_count;
+        uint64_t iterations;
+    };
+
+    typedef struct search_shard search_shard_t;
+
+    struct game_state {
+        board_t initial;
+        search_pool_t pool;
+        search_shard_t shards[max_search_threads];
+        std::atomic<bool> stop_search;
+    };
+
+    typedef game_state game_state_t;
+
+    template <uint16_t N, typename rng_t = search_rng_t>
+    inline void mc_search(board_t& initial, board_pool<N>& pool,
+                          search_shard_t& shard,
                           std::atomic<bool>& stop_search,
-                          uint16_t current_turn) {
-        std::mt19937 mt;
-        bool done = true;
-        player_t& a = search_board.a;
-        player_t& b = search_board.b;
-        copy_board(initial, search_board);
-        while (!stop_search.compare_exchange_weak(done, done)) {
-            done = true;
-            uint16_t initial_a_move = select_move(mt, a);
-            uint16_t initial_b_move = select_move(mt, b);
-            uint32_t final_turn = simulate(mt, a, b, 
-                                           initial_a_move,
-                                           initial_b_move, current_turn);
-            sim_count++;
-            uint16_t index = (get_building_num(initial_a_move) << 7) 
-                | (get_position(initial_a_move) << 1);
-            if (b.health > 0) {
-                move_scores[index + 1]++;
-            } else if (a.health > 0) {
-                move_scores[index] += (final_turn > 60)
-                    & (final_turn < (current_turn + 100));
+                          uint16_t current_turn,
+                          uint64_t seed,
+                          uint8_t worker,
+                          uint64_t iterations) {
+        rng_t rng;
+        seed_worker(rng, seed, worker);
+        uint16_t block = rent_block(pool);
+        assert(block != (uint16_t) -1);
+        board_batch_t initial_batch;
+        for (uint8_t lane = 0; lane < batch_width; lane++) {
+            load_board_lane(initial_batch, lane, initial);
+        }
+        lanes_t initial_a_moves, initial_b_moves;
+        lanes_t final_turns = {};
+        while (!stop_search.load(std::memory_order_relaxed)
+               && (iterations == 0 || shard.iterations < iterations)) {
+            shard.iterations++;
+            store_block(initial_batch, pool, block);
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                initial_a_moves[lane] = select_move(rng, initial.a);
+                initial_b_moves[lane] = select_move(rng, initial.b);
+            }
+            simulate_batch(rng, pool, block, initial_a_moves, initial_b_moves,
+                           current_turn, final_turns);
+            shard.sim_count += batch_width;
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                uint16_t slot = block_slot(block, lane);
+                uint32_t final_turn = final_turns[lane];
+                uint16_t index = (get_building_num(initial_a_moves[lane]) << 7)
+                    | (get_position(initial_a_moves[lane]) << 1);
+                if (pool.b.health[slot] > 0) {
+                    shard.move_scores[index + 1]++;
+                } else if (pool.a.health[slot] > 0) {
+                    shard.move_scores[index] += (final_turn > 60)
+                        & (final_turn < (uint32_t)(current_turn + 100));
+                }
+            }
+        }
+        return_block(pool, block);
+    }
+
+    inline uint8_t search_thread_count(const search_options& options) {
+        return options.threads ? options.threads
+                               : std::min<uint32_t>(available_cpus(), max_search_threads);
+    }
+
+    inline void merge_shards(search_shard_t* shards, uint8_t shard_count,
+                             uint64_t* move_scores) {
+        for (search_shard_t* shard = shards; shard != shards + shard_count; shard++) {
+            for (uint16_t i = 0; i < 768; i++) {
+                move_scores[i] += shard->move_scores[i];
             }
-            copy_board(initial, search_board);
+            sim_count += shard->sim_count;
         }
     }
 
@@ -809,35 +2088,34 @@ namespace bot {
         }
     }
 
-    inline void find_best_move(game_state_t& game_state, uint16_t current_turn) {
+    inline void find_best_move(game_state_t& game_state,
+                               worker_pool& pool,
+                               uint16_t current_turn,
+                               const search_options& options) {
 
         game_state.stop_search.store(false);
+        uint64_t seed = options.seeded ? options.seed : fresh_seed();
+        uint8_t tasks = search_tasks(options, pool.size);
+
+        for (uint8_t i = 0; i < tasks; i++) {
+            submit(pool, [&game_state, &options, current_turn, seed, i] {
+                mc_search<max_search_threads * pool_block_stride, search_rng_t>(
+                    game_state.initial, game_state.pool, game_state.shards[i],
+                    game_state.stop_search, current_turn, seed, i,
+                    worker_iterations(options, i));
+            });
+        }
+        run_until_deadline(pool, options, game_state.stop_search, process_start,
+                           never_stop_early());
 
-        std::thread search1(mc_search, std::ref(game_state.initial),
-                            std::ref(game_state.search1),
-                            game_state.move_scores,
-                            std::ref(game_state.stop_search),
-                            current_turn);
-        std::thread search2(mc_search, std::ref(game_state.initial),
-                            std::ref(game_state.search2),
-                            game_state.move_scores,
-                            std::ref(game_state.stop_search),
-                            current_turn);
-        std::thread search3(mc_search, std::ref(game_state.initial),
-                            std::ref(game_state.search3),
-                            game_state.move_scores,
-                            std::ref(game_state.stop_search),
-                            current_turn);
-        std::thread search4(mc_search, std::ref(game_state.initial),
-                            std::ref(game_state.search4),
-                            game_state.move_scores,
-                            std::ref(game_state.stop_search),
-                            current_turn);
-
-        std::this_thread::sleep_for(std::chrono::milliseconds(1950));
-        game_state.stop_search.store(true);
-
-        std::atomic<uint32_t>* move_scores = game_state.move_scores;
+        uint64_t move_scores[768] = {0};
+        merge_shards(game_state.shards, tasks, move_scores);
+
+        uint64_t iterations[max_search_threads];
+        for (uint8_t i = 0; i < tasks; i++) {
+            iterations[i] = game_state.shards[i].iterations;
+        }
+        print_replay_line(seed, iterations, tasks);
 
         uint64_t best_wins = 0;
         uint64_t best_losses = 0;
@@ -865,37 +2143,24 @@ namespace bot {
         // std::cout << "best row " << (int) best_position << std::endl;
         // std::cout << "best col " << (int) best
         write_command_to_file(row, col, best_building_num);
-
-        search1.join();
-        search2.join();
-        search3.join();
-        search4.join();
     }
 
     uint16_t read_state(game_state_t& game_state, std::string& state_path) {
         std::memset(&(game_state.initial), 0, sizeof(board));
-        std::memset(&(game_state.search1), 0, sizeof(board));
-        std::memset(&(game_state.search2), 0, sizeof(board));
-        std::memset(&(game_state.search3), 0, sizeof(board));
-        std::memset(&(game_state.search4), 0, sizeof(board));
-        for (int i = 0; i < 768; i++) {
-            game_state.move_scores[i] = 0;
-        }
-        std::ifstream state_reader(state_path, std::ios::in);
-        if (state_reader.is_open()) {
-            json game_state_json;
-            state_reader >> game_state_json;
-            return read_from_state(game_state.initial.a, game_state.initial.b, game_state_json);
-        }
-        return -1;
+        clear_pool(game_state.pool);
+        std::memset(game_state.shards, 0, sizeof(game_state.shards));
+        return load_state_file(game_state.initial.a, game_state.initial.b, state_path);
     }
 
-    void move_and_write_to_file() {
+    void move_and_write_to_file(const search_options& options = search_options()) {
         game_state_t game_state;
         std::string state_path("state.json");
         uint16_t current_turn = read_state(game_state, state_path);
         if (current_turn != (uint16_t) -1) {
-            find_best_move(game_state, current_turn);
+            worker_pool pool(search_thread_count(options));
+            start_pool(pool);
+            find_best_move(game_state, pool, current_turn, options);
+            stop_pool(pool);
         }
     }
 
@@ -0,0 +1,44 @@
+#ifndef CPU_H
+#define CPU_H
+
+// The makefile builds for plain x86-64, where counting bits is a library
+// call. The kernels that count bits or work on lanes_t are compiled again
+// for the x86-64-v2 (popcnt) and x86-64-v3 (AVX2, lzcnt) levels and the
+// loader picks the best version the machine runs. Bit helpers are left
+// inline so that every version gets its own copy of them. What the
+// preprocessor sees is the same for every version, so code that checks
+// __BMI2__ or __AVX__, like select_ith_bit and the UCT score width, only
+// changes in a build with -march set to one of those levels, which has one
+// version of everything. GCC before 12 does not know the level names and
+// builds one plain version.
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) && !defined(__AVX2__) && !defined(__clang__) && __GNUC__ >= 12
+#define CPU_DISPATCH 1
+#define CPU_CLONES __attribute__((target_clones("arch=x86-64-v3", "arch=x86-64-v2", "default")))
+#else
+#define CPU_DISPATCH 0
+#define CPU_CLONES
+#endif
+
+namespace bot {
+
+    // The version the loader picks for CPU_CLONES functions on this machine.
+    inline const char* cpu_implementation() {
+#if CPU_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("x86-64-v3")) {
+            return "x86-64-v3 (avx2, lzcnt, popcnt)";
+        } else if (__builtin_cpu_supports("x86-64-v2")) {
+            return "x86-64-v2 (popcnt)";
+        }
+        return "x86-64";
+#else
+        return "as built";
+#endif
+    }
+
+}
+
+#endif
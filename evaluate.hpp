@@ -0,0 +1,117 @@
+#ifndef EVALUATE_H
+#define EVALUATE_H
+
+#include <stdint.h>
+#include <cmath>
+#include "bot.hpp"
+
+namespace bot {
+
+    // Scores a board for self against other as the probability that self
+    // goes on to win. Evaluators are expected to be consistent, with
+    // evaluate(other, self) = 1 - evaluate(self, other).
+    typedef float (*board_evaluator_t)(const player_t& self, const player_t& other);
+
+    // Rollouts in the search stop after horizon turns. One that reaches
+    // full_rollout_turns, or ends with a player dead, is judged by
+    // calculate_reward. One cut off earlier with both players standing
+    // is judged by evaluate instead.
+    struct rollout_policy {
+        uint16_t horizon;
+        board_evaluator_t evaluate;
+    };
+
+    // The number of set bits in each row, one row per byte.
+    inline uint64_t count_per_row(uint64_t bits) {
+        bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+        bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+        return (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    }
+
+    inline uint8_t row_count(uint64_t counts, uint8_t row) {
+        return (counts >> (row << 3)) & 255;
+    }
+
+    // What the evaluator looks at on one side of the board. Counts are per
+    // row, one row per byte; queued buildings count as built.
+    struct side_features {
+        int16_t income;
+        uint64_t attack_buildings;
+        uint64_t defence_layers;
+        uint64_t incoming_missiles;
+    };
+
+    // A defence building has one layer for each hit it can still take, and
+    // a queued one all four. The missiles coming at player are the enemy's,
+    // on either half of the board.
+    inline side_features find_side_features(const player_t& player, const player_t& enemy) {
+        side_features features;
+        features.income = 5 + 3 * count_set_bits(player.energy_buildings
+                                                  | player.energy_building_queue);
+        uint64_t attack_buildings = player.attack_building_queue;
+        uint64_t queued_defence = 0;
+        features.defence_layers = 0;
+        features.incoming_missiles = 0;
+        for (uint8_t i = 0; i < 4; i++) {
+            attack_buildings |= player.attack_buildings[i];
+            queued_defence |= player.defence_building_queue[i];
+            features.defence_layers += count_per_row(player.defence_buildings[i]);
+            features.incoming_missiles += count_per_row(enemy.player_missiles[i])
+                + count_per_row(enemy.enemy_half_missiles[i]);
+        }
+        features.attack_buildings = count_per_row(attack_buildings);
+        features.defence_layers += 4 * count_per_row(queued_defence);
+        return features;
+    }
+
+    // An attack building is worth most in a row the enemy has no defence
+    // in, and less the more layers it has to wear through there. A missile
+    // coming at a row without defence costs its 5 health, one with
+    // defence only a layer.
+    inline float attack_pressure(const side_features& attacker, const side_features& defender) {
+        float pressure = 0;
+        for (uint8_t row = 0; row < 8; row++) {
+            uint8_t attacks = row_count(attacker.attack_buildings, row);
+            uint8_t layers = row_count(defender.defence_layers, row);
+            uint8_t incoming = row_count(defender.incoming_missiles, row);
+            pressure += 12.f * attacks / (1 + layers) + (layers ? 1.f : 5.f) * incoming;
+        }
+        return pressure;
+    }
+
+    // A weighted sum of the features in units of health, squashed into a
+    // probability. A lead of 30 health alone makes self the winner three
+    // times out of four.
+    inline float feature_win_probability(const player_t& self, const player_t& other) {
+        side_features own = find_side_features(self, other);
+        side_features enemy = find_side_features(other, self);
+        float score = (float)self.health - other.health
+            + 2.f * (own.income - enemy.income)
+            + attack_pressure(own, enemy) - attack_pressure(enemy, own);
+        return 1.f / (1.f + std::exp(-score / 27.3f));
+    }
+
+    const rollout_policy full_rollouts = {full_rollout_turns, feature_win_probability};
+
+    inline bool is_cut_off(const rollout_policy& policy, const board_t& board) {
+        return policy.horizon < full_rollout_turns && board.a.health > 0 && board.b.health > 0;
+    }
+
+    // Draws the result of a cut off rollout from the evaluator's
+    // probability, so that the win counts stay whole numbers. As with
+    // calculate_reward, a_reward is what a node of a's is credited with,
+    // which is b winning, and b_reward a winning. One of them always wins.
+    template <typename rng_t>
+    void judge_cut_off(rng_t& rng,
+                       const rollout_policy& policy,
+                       const board_t& board,
+                       uint8_t& a_reward,
+                       uint8_t& b_reward) {
+        float draw = (uint32_t)rng() * (1.f / 4294967296.f);
+        b_reward = draw < policy.evaluate(board.a, board.b);
+        a_reward = !b_reward;
+    }
+
+}
+
+#endif
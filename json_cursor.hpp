@@ -0,0 +1,175 @@
+#ifndef JSON_CURSOR_H
+#define JSON_CURSOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+namespace bot {
+
+    // A forward-only reader over a JSON text held in memory. Nothing is
+    // copied or allocated: strings come back as pointers into the buffer
+    // and values the caller does not ask for are skipped in place. Any
+    // unexpected character sets failed and moves the cursor to the end, so
+    // every loop over a malformed document terminates.
+    struct json_cursor {
+        const char* at;
+        const char* end;
+        bool failed;
+
+        json_cursor(const char* begin, const char* end) : at(begin), end(end), failed(false) {
+        }
+    };
+
+    struct json_string {
+        const char* begin;
+        size_t length;
+    };
+
+    inline void fail(json_cursor& cursor) {
+        cursor.failed = true;
+        cursor.at = cursor.end;
+    }
+
+    inline void skip_space(json_cursor& cursor) {
+        while (cursor.at != cursor.end && (*cursor.at == ' ' || *cursor.at == '\n' ||
+                                           *cursor.at == '\r' || *cursor.at == '\t')) {
+            cursor.at++;
+        }
+    }
+
+    inline bool consume(json_cursor& cursor, char expected) {
+        skip_space(cursor);
+        if (cursor.at != cursor.end && *cursor.at == expected) {
+            cursor.at++;
+            return true;
+        }
+        return false;
+    }
+
+    inline void expect(json_cursor& cursor, char expected) {
+        if (!consume(cursor, expected)) {
+            fail(cursor);
+        }
+    }
+
+    // Objects and arrays are walked with
+    //     expect(cursor, '{');
+    //     while (next_member(cursor, '}')) { ... }
+    // which also steps over the comma between members.
+    inline bool next_member(json_cursor& cursor, char close) {
+        if (consume(cursor, close)) {
+            return false;
+        }
+        if (cursor.at == cursor.end) {
+            fail(cursor);
+            return false;
+        }
+        consume(cursor, ',');
+        return true;
+    }
+
+    inline json_string read_string(json_cursor& cursor) {
+        json_string result = {cursor.end, 0};
+        if (!consume(cursor, '"')) {
+            fail(cursor);
+            return result;
+        }
+        result.begin = cursor.at;
+        while (cursor.at < cursor.end && *cursor.at != '"') {
+            cursor.at += (*cursor.at == '\\') + 1;
+        }
+        if (cursor.at >= cursor.end) {
+            fail(cursor);
+            return result;
+        }
+        result.length = cursor.at - result.begin;
+        cursor.at++;
+        return result;
+    }
+
+    inline json_string read_key(json_cursor& cursor) {
+        json_string key = read_string(cursor);
+        expect(cursor, ':');
+        return key;
+    }
+
+    inline bool equals(const json_string& string, const char* literal) {
+        return string.length == std::strlen(literal) &&
+            std::memcmp(string.begin, literal, string.length) == 0;
+    }
+
+    inline int64_t read_int(json_cursor& cursor) {
+        skip_space(cursor);
+        bool negative = consume(cursor, '-');
+        if (cursor.at == cursor.end || *cursor.at < '0' || *cursor.at > '9') {
+            fail(cursor);
+            return 0;
+        }
+        int64_t value = 0;
+        while (cursor.at != cursor.end && *cursor.at >= '0' && *cursor.at <= '9') {
+            value = value * 10 + (*cursor.at++ - '0');
+        }
+        return negative ? -value : value;
+    }
+
+    inline bool read_bool(json_cursor& cursor) {
+        skip_space(cursor);
+        if (cursor.end - cursor.at >= 4 && std::memcmp(cursor.at, "true", 4) == 0) {
+            cursor.at += 4;
+            return true;
+        }
+        if (cursor.end - cursor.at >= 5 && std::memcmp(cursor.at, "false", 5) == 0) {
+            cursor.at += 5;
+            return false;
+        }
+        fail(cursor);
+        return false;
+    }
+
+    // Numbers and literals are skipped by running to the next delimiter,
+    // objects and arrays by counting brackets outside of strings.
+    inline void skip_value(json_cursor& cursor) {
+        skip_space(cursor);
+        uint32_t depth = 0;
+        while (cursor.at != cursor.end) {
+            char c = *cursor.at;
+            if (c == '"') {
+                read_string(cursor);
+            } else if (c == '{' || c == '[') {
+                depth++;
+                cursor.at++;
+            } else if (c == '}' || c == ']') {
+                if (depth == 0) {
+                    return;
+                }
+                depth--;
+                cursor.at++;
+            } else if (c == ',' && depth == 0) {
+                return;
+            } else {
+                cursor.at++;
+            }
+            if (depth == 0 && (c == '"' || c == '}' || c == ']')) {
+                return;
+            }
+        }
+    }
+
+    inline bool read_file(const std::string& path, std::string& contents) {
+        std::ifstream reader(path, std::ios::in | std::ios::binary);
+        if (!reader.is_open()) {
+            return false;
+        }
+        reader.seekg(0, std::ios::end);
+        contents.resize(reader.tellg());
+        reader.seekg(0, std::ios::beg);
+        reader.read(&contents[0], contents.size());
+        return true;
+    }
+
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace bot {
+
+    // Passing --seed together with --iterations replays a search exactly:
+    // every worker gets the same random stream and stops after the same
+    // number of iterations, so thread timing cannot change the result.
+    //
+    // --daemon keeps the process alive between rounds, see run_daemon.
+    // --threads overrides the number of search threads, which otherwise
+    // follows the CPUs the process is allowed to use. Either way there are
+    // at most max_search_threads threads and search tasks.
+    // --deadline is the time in milliseconds, counted from the start of
+    // the process, by which the move has to be written; searching stops
+    // --margin milliseconds before it to leave time for writing it.
+    // --tree-parallel has all workers descend one shared tree instead of
+    // growing a tree each and summing their root statistics. The order in
+    // which workers update a shared tree depends on timing, so a seeded
+    // replay is only exact without it.
+    // --memory-budget caps the megabytes all search trees together may
+    // commit, by default three quarters of the memory available to us.
+    // --no-huge-pages keeps the kernel from backing trees with huge pages.
+    // --horizon cuts rollouts off after 1 to full_rollout_turns turns and
+    // has the static evaluator judge the board; by default they run full
+    // length.
+    // The flat search has one board pool block per task, and a pool holds
+    // 64 blocks.
+    const uint8_t max_search_threads = 64;
+
+    // Rollouts are played out for this many turns unless a shorter horizon
+    // is asked for.
+    const uint16_t full_rollout_turns = 120;
+
+    struct search_options {
+        bool seeded;
+        uint64_t seed;
+        std::vector<uint64_t> iterations;
+        bool daemon;
+        bool tree_parallel;
+        uint8_t threads;
+        uint32_t deadline;
+        uint32_t margin;
+        uint64_t memory_budget;
+        bool huge_pages;
+        uint16_t horizon;
+
+        search_options()
+            : seeded(false), seed(0), daemon(false), tree_parallel(false), threads(0),
+              deadline(2000), margin(100), memory_budget(0), huge_pages(true),
+              horizon(full_rollout_turns) {
+        }
+    };
+
+    // A search is split into one task per thread, except that a list of
+    // iteration counts replays one task per count whatever the number of
+    // threads.
+    inline uint8_t search_tasks(const search_options& options, uint8_t threads) {
+        size_t tasks = options.iterations.size() > 1 ? options.iterations.size() : threads;
+        return std::min<size_t>(tasks, max_search_threads);
+    }
+
+    // Zero means the worker runs until it is told to stop.
+    inline uint64_t worker_iterations(const search_options& options, uint8_t worker) {
+        if (options.iterations.empty()) {
+            return 0;
+        }
+        return options.iterations[std::min<size_t>(worker, options.iterations.size() - 1)];
+    }
+
+    inline std::vector<uint64_t> parse_counts(const char* counts) {
+        std::vector<uint64_t> result;
+        char* end = const_cast<char*>(counts);
+        while (*end) {
+            result.push_back(std::strtoull(end, &end, 10));
+            end += (*end == ',');
+        }
+        return result;
+    }
+
+    inline search_options parse_search_options(int argc, char** argv) {
+        search_options options;
+        for (int i = 1; i < argc; i++) {
+            if (!std::strcmp(argv[i], "--seed") && i + 1 < argc) {
+                options.seeded = true;
+                options.seed = std::strtoull(argv[++i], 0, 10);
+            } else if (!std::strcmp(argv[i], "--iterations") && i + 1 < argc) {
+                options.iterations = parse_counts(argv[++i]);
+            } else if (!std::strcmp(argv[i], "--daemon")) {
+                options.daemon = true;
+            } else if (!std::strcmp(argv[i], "--threads") && i + 1 < argc) {
+                unsigned long threads = std::strtoul(argv[++i], 0, 10);
+                if (threads < 1 || threads > max_search_threads) {
+                    std::cerr << "--threads takes 1 to " << (int)max_search_threads
+                              << ", ignoring " << argv[i] << std::endl;
+                } else {
+                    options.threads = threads;
+                }
+            } else if (!std::strcmp(argv[i], "--deadline") && i + 1 < argc) {
+                options.deadline = std::strtoul(argv[++i], 0, 10);
+            } else if (!std::strcmp(argv[i], "--margin") && i + 1 < argc) {
+                options.margin = std::strtoul(argv[++i], 0, 10);
+            } else if (!std::strcmp(argv[i], "--tree-parallel")) {
+                options.tree_parallel = true;
+            } else if (!std::strcmp(argv[i], "--memory-budget") && i + 1 < argc) {
+                options.memory_budget = std::strtoull(argv[++i], 0, 10) << 20;
+            } else if (!std::strcmp(argv[i], "--no-huge-pages")) {
+                options.huge_pages = false;
+            } else if (!std::strcmp(argv[i], "--horizon") && i + 1 < argc) {
+                unsigned long horizon = std::strtoul(argv[++i], 0, 10);
+                if (horizon < 1 || horizon > full_rollout_turns) {
+                    std::cerr << "--horizon takes 1 to " << full_rollout_turns
+                              << ", ignoring " << argv[i] << std::endl;
+                } else {
+                    options.horizon = horizon;
+                }
+            } else {
+                std::cerr << "unknown option " << argv[i] << std::endl;
+            }
+        }
+        if (options.iterations.size() > max_search_threads) {
+            std::cerr << "--iterations takes at most " << (int)max_search_threads
+                      << " counts, replaying the first " << (int)max_search_threads << std::endl;
+            options.iterations.resize(max_search_threads);
+        }
+        options.margin = std::min(options.margin, options.deadline);
+        return options;
+    }
+
+    inline void print_replay_line(uint64_t seed, const uint64_t* iterations, uint8_t workers) {
+        std::cout << "replay with --seed " << seed << " --iterations ";
+        for (uint8_t i = 0; i < workers; i++) {
+            std::cout << (i ? "," : "") << iterations[i];
+        }
+        std::cout << std::endl;
+    }
+
+}
+
+#endif
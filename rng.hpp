@@ -0,0 +1,177 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <random>
+
+namespace bot {
+
+    const uint64_t golden_gamma = 0x9E3779B97F4A7C15ULL;
+
+    inline uint64_t splitmix64(uint64_t& state) {
+        uint64_t z = (state += golden_gamma);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    inline uint64_t fresh_seed() {
+        std::random_device device;
+        uint64_t state = ((uint64_t)device() << 32) | device();
+        state ^= std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        return splitmix64(state);
+    }
+
+    inline uint64_t rotate_left(uint64_t x, uint8_t k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    // xoshiro256** by Blackman and Vigna: 32 bytes of state and a jump
+    // function that advances 2^128 steps, so workers can take disjoint
+    // slices of a single sequence.
+    struct xoshiro256ss {
+        typedef uint64_t result_type;
+        uint64_t s[4];
+
+        explicit xoshiro256ss(uint64_t seed = golden_gamma) {
+            this->seed(seed);
+        }
+
+        void seed(uint64_t seed) {
+            for (uint8_t i = 0; i < 4; i++) {
+                s[i] = splitmix64(seed);
+            }
+        }
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return ~(result_type)0; }
+
+        result_type operator()() {
+            uint64_t result = rotate_left(s[1] * 5, 7) * 9;
+            uint64_t t = s[1] << 17;
+            s[2] ^= s[0];
+            s[3] ^= s[1];
+            s[1] ^= s[2];
+            s[0] ^= s[3];
+            s[2] ^= t;
+            s[3] = rotate_left(s[3], 45);
+            return result;
+        }
+
+        void jump() {
+            static const uint64_t jump_polynomial[4] = {
+                0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL,
+                0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL
+            };
+            uint64_t jumped[4] = {0, 0, 0, 0};
+            for (uint8_t i = 0; i < 4; i++) {
+                for (uint8_t b = 0; b < 64; b++) {
+                    if (jump_polynomial[i] & ((uint64_t)1 << b)) {
+                        for (uint8_t j = 0; j < 4; j++) {
+                            jumped[j] ^= s[j];
+                        }
+                    }
+                    (*this)();
+                }
+            }
+            for (uint8_t j = 0; j < 4; j++) {
+                s[j] = jumped[j];
+            }
+        }
+
+        // Every output carries two independent 32 bit words.
+        void fill(uint32_t* out, size_t count) {
+            for (; count > 1; count -= 2, out += 2) {
+                uint64_t bits = (*this)();
+                out[0] = bits;
+                out[1] = bits >> 32;
+            }
+            if (count) {
+                *out = (*this)() >> 32;
+            }
+        }
+    };
+
+    // PCG-XSH-RR by O'Neill: 16 bytes of state, with the increment
+    // selecting one of 2^63 distinct streams.
+    struct pcg32 {
+        typedef uint32_t result_type;
+        uint64_t state;
+        uint64_t increment;
+
+        explicit pcg32(uint64_t seed = golden_gamma, uint64_t stream = 0) {
+            this->seed(seed, stream);
+        }
+
+        void seed(uint64_t seed, uint64_t stream = 0) {
+            state = 0;
+            increment = (stream << 1) | 1;
+            (*this)();
+            state += seed;
+            (*this)();
+        }
+
+        static constexpr result_type min() { return 0; }
+        static constexpr result_type max() { return ~(result_type)0; }
+
+        result_type operator()() {
+            uint64_t old_state = state;
+            state = old_state * 6364136223846793005ULL + increment;
+            uint32_t xorshifted = ((old_state >> 18) ^ old_state) >> 27;
+            uint32_t rotation = old_state >> 59;
+            return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+        }
+
+        void fill(uint32_t* out, size_t count) {
+            for (uint32_t* end = out + count; out != end; out++) {
+                *out = (*this)();
+            }
+        }
+    };
+
+    typedef xoshiro256ss search_rng_t;
+
+    template <typename rng_t>
+    inline void fill_random_bits(rng_t& rng, uint32_t* out, size_t count) {
+        rng.fill(out, count);
+    }
+
+    inline void fill_random_bits(std::mt19937& mt, uint32_t* out, size_t count) {
+        for (uint32_t* end = out + count; out != end; out++) {
+            *out = mt();
+        }
+    }
+
+    // Splits one search seed into a stream per worker. Worker w jumps
+    // w * 2^32 steps ahead in the splitmix64 sequence of the seed and
+    // expands the values found there into the full generator state, so
+    // workers never share a random sequence and the same seed always gives
+    // every worker the same stream.
+    inline void seed_worker(std::mt19937& mt, uint64_t seed, uint32_t worker) {
+        uint64_t state = seed + golden_gamma * ((uint64_t)worker << 32);
+        uint32_t words[8];
+        for (uint8_t i = 0; i < 8; i += 2) {
+            uint64_t bits = splitmix64(state);
+            words[i] = bits;
+            words[i + 1] = bits >> 32;
+        }
+        std::seed_seq sequence(words, words + 8);
+        mt.seed(sequence);
+    }
+
+    inline void seed_worker(xoshiro256ss& rng, uint64_t seed, uint32_t worker) {
+        rng.seed(seed);
+        for (uint32_t i = 0; i < worker; i++) {
+            rng.jump();
+        }
+    }
+
+    inline void seed_worker(pcg32& rng, uint64_t seed, uint32_t worker) {
+        rng.seed(splitmix64(seed), worker);
+    }
+
+}
+
+#endif
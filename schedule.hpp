@@ -0,0 +1,65 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include "options.hpp"
+#include "worker_pool.hpp"
+
+namespace bot {
+
+    typedef std::chrono::steady_clock search_clock_t;
+
+    // Initialised before main runs, which is as close to the start of the
+    // process as the engines can get. The turn limit counts from the moment
+    // the runner starts us, not from when the state has been parsed.
+    const search_clock_t::time_point process_start = search_clock_t::now();
+
+    const std::chrono::milliseconds deadline_poll_interval(5);
+
+    inline search_clock_t::time_point search_deadline(const search_options& options,
+                                                      search_clock_t::time_point start) {
+        return start + std::chrono::milliseconds(options.deadline - options.margin);
+    }
+
+    struct never_stop_early {
+        bool operator()(search_clock_t::duration, search_clock_t::duration) const {
+            return false;
+        }
+    };
+
+    // Lets the tasks in the pool run until the deadline counted from start,
+    // or until stop_early(elapsed, remaining) says further iterations cannot
+    // change the answer. It is asked every deadline_poll_interval, with
+    // elapsed measured from the call. Searches given a number of iterations
+    // to replay ignore the clock and run to completion.
+    template <typename stop_early_t>
+    void run_until_deadline(worker_pool& pool,
+                            const search_options& options,
+                            std::atomic<bool>& stop_search,
+                            search_clock_t::time_point start,
+                            stop_early_t stop_early) {
+        if (!options.iterations.empty()) {
+            wait_for_tasks(pool);
+            return;
+        }
+        search_clock_t::time_point searching_since = search_clock_t::now();
+        search_clock_t::time_point deadline = search_deadline(options, start);
+        for (;;) {
+            search_clock_t::time_point now = search_clock_t::now();
+            if (now >= deadline || stop_early(now - searching_since, deadline - now)) {
+                break;
+            }
+            if (wait_for_tasks_until(pool, std::min(now + deadline_poll_interval, deadline))) {
+                return;
+            }
+        }
+        stop_search.store(true, std::memory_order_relaxed);
+        wait_for_tasks(pool);
+    }
+
+}
+
+#endif
@@ -1,6 +1,13 @@
 #include "search.hpp"
 
-int main() {
-    bot::find_best_move_and_write_to_file<bot::total_free_bytes>();
+int main(int argc, char** argv) {
+    bot::search_options options = bot::parse_search_options(argc, argv);
+    bot::configure_memory(options.memory_budget, options.huge_pages);
+    std::cout << "cpu kernels " << bot::cpu_implementation() << std::endl;
+    if (options.daemon) {
+        bot::run_daemon<bot::total_free_bytes>(options);
+    } else {
+        bot::find_best_move_and_write_to_file<bot::total_free_bytes>(options);
+    }
     return 0;
 }
@@ -2,47 +2,76 @@
 #define SEARCH_H
 
 #include "bot.hpp"
+#include "evaluate.hpp"
+#include "transposition.hpp"
+#include "arena.hpp"
+#include "uct.hpp"
 #include <assert.h>
 #include <stdint.h>
 #include <algorithm>
 #include <cmath>
+#include <functional>
 #include <random>
+#include <unordered_map>
+#include <vector>
 #include <time.h>
 
 namespace bot {
 
-    const float exploration = std::sqrt(2);
     uint64_t new_node_count = 0;
-    const uint32_t total_free_bytes = 500000000;
-
+    const uint32_t total_free_bytes = 2000000000;
+    const uint32_t table_buckets = 1 << 15;
+
+    // A tree lives in one arena. The other one is where promote_root
+    // copies the subtree that survives a round. Each arena reserves N bytes
+    // of address space, but only what the tree has grown into is backed by
+    // memory. An arena that could not be reserved leaves the tree without
+    // room, and it is searched by rollouts from the root alone.
     template <uint32_t N>
     struct thread_state {
         uint8_t buffer_index = 0;
-        uint8_t buffer[2][N];
-        float distribution[203041] = {0};
-        uint32_t free_index = 0;
+        arena buffer[2];
+        transposition_table<table_buckets> table;
         thread_state() {
-
+            reserve_arena(buffer[0], N);
+            reserve_arena(buffer[1], N);
+            clear_table(table);
         }
     };
 
+    // Room kept committed ahead of a search, more than one iteration of
+    // sm_mcts allocates. A tree stops growing once the memory budget does
+    // not cover it.
+    const uint64_t iteration_reserve_bytes = 64 << 10;
+
+    // Arena offsets are multiples of a cache line, so an index holds the
+    // offset in units of 8 bytes with the arena it belongs to in the lowest bit.
+    // An allocation that does not fit returns (uint32_t)-1, the index of no
+    // block, and its caller stops expanding.
+    //
+    // Workers of a shared tree allocate from the same thread_state, hence
+    // the atomic bump inside the arena.
     template <uint32_t N>
     uint32_t allocate_memory(thread_state<N>& thread_state, uint32_t bytes) {
-        if (bytes + thread_state.free_index >= N && thread_state.buffer_index < 1) {
-            thread_state.buffer_index++;
-            thread_state.free_index = 0;
+        uint64_t offset = arena_allocate(thread_state.buffer[thread_state.buffer_index], bytes);
+        if (offset == arena_full) {
+            return (uint32_t)-1;
         }
-        uint32_t index_number = thread_state.buffer_index | (thread_state.free_index << 3);
-        assert(thread_state.free_index + bytes < total_free_bytes);
-        thread_state.free_index += bytes;
-        return index_number;
+        return thread_state.buffer_index | (offset >> 3);
     }
 
     template <uint32_t N>
     void* get_buffer_by_index(thread_state<N>& thread_state, uint32_t index) {
-        return &(thread_state.buffer[index & 7][index >> 3]);
+        return thread_state.buffer[index & 1].base + ((uint64_t)(index & ~1u) << 3);
+    }
+
+    template <uint32_t N>
+    bool tree_has_room(thread_state<N>& thread_state) {
+        return arena_has_room(thread_state.buffer[thread_state.buffer_index],
+                              iteration_reserve_bytes);
     }
 
+    CPU_CLONES
     uint16_t calculate_number_of_choices(player_t& player) {
         uint16_t number_of_choices;
         uint64_t unoccupied = ~find_occupied(player);
@@ -65,10 +94,9 @@ namespace bot {
         return 64 - select_ith_bit(unoccupied, normalized_choice);
     }
 
-    uint16_t decode_move(uint16_t player_choice,
-                         player_t& player,
-                         uint16_t number_of_choices) {
-        uint64_t unoccupied = ~find_occupied(player);
+    inline uint16_t decode_free_move(uint16_t player_choice,
+                                     uint64_t unoccupied,
+                                     uint16_t number_of_choices) {
         uint8_t available = count_set_bits(unoccupied);
         uint8_t position = calculate_selected_position(player_choice, unoccupied);
         assert(position >= 0 && position < 64);
@@ -99,64 +127,595 @@ namespace bot {
         }
     }
 
+    // Choices count the free positions from the highest bit down. With
+    // mirrored set they are counted on the mirror image of the board and
+    // the move mirrored back, so that a position and its mirror image
+    // number their moves alike and can share children.
+    CPU_CLONES
+    uint16_t decode_move(uint16_t player_choice,
+                         player_t& player,
+                         uint16_t number_of_choices,
+                         bool mirrored = false) {
+        uint64_t unoccupied = ~find_occupied(player);
+        if (mirrored) {
+            return mirror_move(decode_free_move(player_choice, mirror_rows(unoccupied),
+                                                number_of_choices));
+        }
+        return decode_free_move(player_choice, unoccupied, number_of_choices);
+    }
+
+    const uint16_t max_choices = 4 * 64 + 1;
+
+    // Every move of a player, indexed by choice as decode_move numbers
+    // them, for the position with the given key.
+    struct move_list {
+        uint64_t key;
+        uint16_t number_of_choices;
+        uint16_t moves[max_choices];
+    };
+
+    // Does for every choice at once what decode_move does for one: the free
+    // positions are found once, from the highest bit down, which is the
+    // order select_ith_bit counts them in.
+    CPU_CLONES
+    inline void generate_moves(player_t& player,
+                               uint16_t number_of_choices,
+                               move_list& list,
+                               bool mirrored = false) {
+        list.number_of_choices = number_of_choices;
+        uint64_t unoccupied = ~find_occupied(player);
+        uint8_t available = count_set_bits(unoccupied);
+        if (available == 0) {
+            for (uint16_t choice = 0; choice < number_of_choices; choice++) {
+                list.moves[choice] = decode_move(choice, player, number_of_choices, mirrored);
+            }
+            return;
+        }
+        uint8_t flip = mirrored ? 56 : 0;
+        unoccupied = mirrored ? mirror_rows(unoccupied) : unoccupied;
+        uint16_t positions[64];
+        for (uint8_t i = 0; i < available; i++) {
+            uint8_t position = 63 - __builtin_clzll(unoccupied);
+            positions[i] = (position ^ flip) << 3;
+            unoccupied ^= (uint64_t)1 << position;
+        }
+        bool with_iron_curtain = number_of_choices == available * 4 + 1;
+        list.moves[0] = with_iron_curtain ? (mirrored ? mirror_move(5) : 5) : 0;
+        if (number_of_choices == available + 1) {
+            for (uint8_t i = 0; i < available; i++) {
+                list.moves[1 + i] = 3 | positions[i];
+            }
+            return;
+        }
+        for (uint16_t choice = 1; choice < number_of_choices; choice++) {
+            uint8_t building_num = (choice - 1) / available + 1;
+            if (with_iron_curtain && building_num == 4) {
+                building_num = 5;
+            }
+            list.moves[choice] = building_num | positions[(choice - 1) % available];
+        }
+    }
+
+    // Recently used move lists, one per slot, found by the player's hash.
+    // Both players' moves are looked up on every step of every descent, and
+    // the positions near the root come back on every iteration. The hash
+    // covers everything find_occupied reads, and the number of choices
+    // stands in for the energy. Lists counted on the mirror image have
+    // their key inverted.
+    const uint32_t move_cache_slots = 1 << 9;
+
+    struct move_cache {
+        move_list lists[move_cache_slots];
+
+        move_cache() {
+            for (move_list& list : lists) {
+                list.key = 0;
+                list.number_of_choices = 0;
+            }
+        }
+    };
+
+    // Workers of a shared tree share its thread_state, so the cache belongs
+    // to the thread instead.
+    inline move_cache& thread_move_cache() {
+        static thread_local move_cache cache;
+        return cache;
+    }
+
+    // Most positions below the top of the tree are only seen once, so a
+    // list is only generated the second time its position comes up. The
+    // first time the key is merely noted and the move decoded on its own.
+    inline uint16_t cached_move(uint16_t choice,
+                                player_t& player,
+                                uint16_t number_of_choices,
+                                bool mirrored = false) {
+        uint64_t key = mirrored ? ~player.hash : player.hash;
+        move_list& list = thread_move_cache().lists[key & (move_cache_slots - 1)];
+        if (list.key == key && list.number_of_choices == number_of_choices) {
+            return list.moves[choice];
+        }
+        if (list.key != key) {
+            list.key = key;
+            list.number_of_choices = 0;
+            return decode_move(choice, player, number_of_choices, mirrored);
+        }
+        generate_moves(player, number_of_choices, list, mirrored);
+        return list.moves[choice];
+    }
+
+    // The children of a node live in blocks of parallel arrays: visit
+    // counts, win counts, children indices, numbers of choices and proofs.
+    // Picking a child only reads the first two arrays and the proofs,
+    // which are dense, instead of every child's whole node. Blocks start
+    // on a cache line and each array has room for a multiple of 16
+    // children, so the arrays of counts, indices and numbers of choices
+    // start on one too. The proofs start 14 bytes per child in, which is
+    // only a multiple of 32, but no group of proofs selection reads at once
+    // crosses a cache line. The index of the next block follows the
+    // arrays, and after it the links the first block of a position keeps
+    // to the rest of it, see replies_of and the joint table.
+    //
+    // Children are visited in order, so a node only holds blocks up to its
+    // first unvisited child, and gets a new one when selection reaches the
+    // end of the last. Block k holds children [first, 2 * first), with
+    // first = 16 << (k - 1), except that block 0 holds children [0, 16)
+    // and the last one only what is left of number_of_choices. Blocks are
+    // never moved, so children shared through the transposition table and
+    // workers of a shared tree always see the same ones.
+    const uint16_t child_block_base = 16;
+
+    inline uint32_t child_block_capacity(uint16_t number_of_choices) {
+        return (number_of_choices + child_block_base - 1) & ~(child_block_base - 1u);
+    }
+
+    constexpr uint32_t child_block_bytes(uint16_t capacity) {
+        return capacity * (3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t))
+            + 3 * sizeof(uint32_t) + sizeof(uint16_t);
+    }
+
+    inline uint16_t child_block_first(uint8_t block) {
+        return block == 0 ? 0 : child_block_base << (block - 1);
+    }
+
+    inline uint16_t child_block_size(uint8_t block, uint16_t number_of_choices) {
+        uint16_t first = child_block_first(block);
+        return std::min<uint32_t>(block == 0 ? child_block_base : first,
+                                  child_block_capacity(number_of_choices - first));
+    }
+
+    inline uint8_t child_block_of(uint16_t child) {
+        return child < child_block_base ? 0 : 32 - __builtin_clz(child / child_block_base);
+    }
+
+    template <uint32_t N> struct child_block;
+
+    // Moves are simultaneous, so a position keeps the statistics of each
+    // player's choices apart, with those of a as the children of its node
+    // and those of b in a block of replies. The positions reached are only
+    // stored for the pairs of choices that were played, in a hash table
+    // keyed by both. A position costs the sum of the players' choices
+    // rather than their product, and every visit of a choice counts
+    // whatever the other player chose.
+    //
+    // A node is a view of its slot in a block: a position in the joint
+    // table of its parent, whose statistics and proof are those of b, or a
+    // choice of a player, whose are that player's. The root has a block
+    // of its own.
     template <uint32_t N>
     struct player_node {
-        uint16_t number_of_choices = 0;
-        uint32_t children = (uint32_t)-1;
-        uint32_t simulations = 0;
-        uint32_t wins = 0;
-
-        player_node() {
-            number_of_choices = 0;
-            children = (uint32_t)-1;
-            simulations = 0;
-            wins = 0;
-        }
-
-        explicit player_node(player_t& player) {
-            number_of_choices = calculate_number_of_choices(player);
-        }
-
-        player_node<N>* get_children(thread_state<N>& thread_state) {
-            if (children == (uint32_t)-1) {
-                children = allocate_memory(thread_state, number_of_choices * sizeof(player_node));
-                player_node<N>* result =
-                    static_cast<player_node<N>*>(get_buffer_by_index(thread_state, children));
-                for (auto node = result; node != result + number_of_choices; ++node) {
-                    node->number_of_choices = 0;
-                    // node->number_of_choices = 0;
-                    // node->simulations = 0;
-                    // node->wins = 0;
-                }
-                return result;
+        uint16_t& number_of_choices;
+        uint32_t& children;
+        uint32_t& simulations;
+        uint32_t& wins;
+        uint8_t& proof;
+
+        player_node(uint16_t& number_of_choices,
+                    uint32_t& children,
+                    uint32_t& simulations,
+                    uint32_t& wins,
+                    uint8_t& proof)
+            : number_of_choices(number_of_choices), children(children),
+              simulations(simulations), wins(wins), proof(proof) {
+        }
+
+        child_block<N> get_children(thread_state<N>& thread_state);
+    };
+
+    template <uint32_t N>
+    struct child_block {
+        uint32_t* simulations;
+        uint32_t* wins;
+        uint32_t* children;
+        uint16_t* number_of_choices;
+        uint8_t* proofs;
+        uint32_t* next;
+        uint32_t* replies;
+        uint32_t* joint;
+        uint16_t* reply_choices;
+        uint8_t block;
+        uint16_t first;
+        uint16_t capacity;
+
+        child_block(void* memory, uint8_t block, uint16_t first, uint16_t capacity)
+            : block(block), first(first), capacity(capacity) {
+            simulations = static_cast<uint32_t*>(memory);
+            wins = simulations + capacity;
+            children = wins + capacity;
+            number_of_choices = reinterpret_cast<uint16_t*>(children + capacity);
+            proofs = reinterpret_cast<uint8_t*>(number_of_choices + capacity);
+            next = reinterpret_cast<uint32_t*>(proofs + capacity);
+            replies = next + 1;
+            joint = next + 2;
+            reply_choices = reinterpret_cast<uint16_t*>(next + 3);
+        }
+
+        // i counts from the first child of the block.
+        player_node<N> operator[](uint16_t i) const {
+            return player_node<N>(number_of_choices[i], children[i], simulations[i], wins[i],
+                                  proofs[i]);
+        }
+    };
+
+    template <uint32_t N>
+    child_block<N> get_child_block(thread_state<N>& thread_state,
+                                   uint32_t index,
+                                   uint8_t block,
+                                   uint16_t number_of_choices) {
+        return child_block<N>(get_buffer_by_index(thread_state, index), block,
+                              child_block_first(block),
+                              child_block_size(block, number_of_choices));
+    }
+
+    template <uint32_t N>
+    void clear_child_block(child_block<N> block) {
+        std::memset(block.simulations, 0, 2 * block.capacity * sizeof(uint32_t));
+        std::memset(block.children, 0xff, block.capacity * sizeof(uint32_t));
+        std::memset(block.number_of_choices, 0, block.capacity * sizeof(uint16_t));
+        std::memset(block.proofs, unproven, block.capacity);
+        *block.next = (uint32_t)-1;
+        *block.replies = (uint32_t)-1;
+        *block.joint = (uint32_t)-1;
+        *block.reply_choices = 0;
+    }
+
+    template <uint32_t N>
+    uint32_t allocate_child_block(thread_state<N>& thread_state, uint16_t capacity) {
+        uint32_t index = allocate_memory(thread_state, child_block_bytes(capacity));
+        if (index == (uint32_t)-1) {
+            return index;
+        }
+        clear_child_block(child_block<N>(get_buffer_by_index(thread_state, index), 0, 0,
+                                         capacity));
+        return index;
+    }
+
+    // Follows link to a block, allocating it with allocate() first if it
+    // is missing, and returns (uint32_t)-1 if that fails. Expansion is
+    // lock-free: a worker that loses the race to publish its block takes
+    // the winner's and leaves its own unused.
+    template <typename allocate_t>
+    uint32_t expand_link(uint32_t& link, allocate_t allocate) {
+        uint32_t index = __atomic_load_n(&link, __ATOMIC_ACQUIRE);
+        if (index == (uint32_t)-1) {
+            index = allocate();
+            if (index == (uint32_t)-1) {
+                return index;
+            }
+            uint32_t expected = (uint32_t)-1;
+            if (!__atomic_compare_exchange_n(&link, &expected, index, false,
+                                             __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                index = expected;
             }
-            player_node<N>* result =
-                static_cast<player_node<N>*>(get_buffer_by_index(thread_state, children));
-            return result;
         }
+        return index;
+    }
+
+    template <uint32_t N>
+    uint32_t expand_link(thread_state<N>& thread_state, uint32_t& link, uint16_t capacity) {
+        return expand_link(link, [&] { return allocate_child_block(thread_state, capacity); });
+    }
+
+    // The first block of children, allocated on the first call. Like
+    // get_child, it expects the arena to have room, which expand_to_child
+    // checks for.
+    template <uint32_t N>
+    child_block<N> player_node<N>::get_children(thread_state<N>& thread_state) {
+        uint32_t index = expand_link(thread_state, children,
+                                     child_block_size(0, number_of_choices));
+        return get_child_block(thread_state, index, 0, number_of_choices);
+    }
+
+    // Moves block on to the next one unless the node has none after it.
+    template <uint32_t N>
+    bool next_child_block(thread_state<N>& thread_state,
+                          uint16_t number_of_choices,
+                          child_block<N>& block) {
+        uint32_t index = __atomic_load_n(block.next, __ATOMIC_ACQUIRE);
+        if (index == (uint32_t)-1) {
+            return false;
+        }
+        block = get_child_block(thread_state, index, block.block + 1, number_of_choices);
+        return true;
+    }
 
+    // The child with the given index, allocating the blocks up to it.
+    template <uint32_t N>
+    player_node<N> get_child(thread_state<N>& thread_state,
+                             player_node<N> node,
+                             uint16_t child) {
+        child_block<N> block = node.get_children(thread_state);
+        for (uint8_t next = 1; next <= child_block_of(child); next++) {
+            uint32_t index = expand_link(thread_state, *block.next,
+                                         child_block_size(next, node.number_of_choices));
+            block = get_child_block(thread_state, index, next, node.number_of_choices);
+        }
+        return block[child - block.first];
+    }
+
+    // Allocates the blocks of node up to the one holding child. Returns
+    // false if the arena has no room left for them.
+    template <uint32_t N>
+    bool expand_to_child(thread_state<N>& thread_state, player_node<N> node, uint16_t child) {
+        uint32_t index = expand_link(thread_state, node.children,
+                                     child_block_size(0, node.number_of_choices));
+        for (uint8_t next = 1; index != (uint32_t)-1 && next <= child_block_of(child); next++) {
+            child_block<N> block = get_child_block(thread_state, index, next - 1,
+                                                   node.number_of_choices);
+            index = expand_link(thread_state, *block.next,
+                                child_block_size(next, node.number_of_choices));
+        }
+        return index != (uint32_t)-1;
+    }
+
+    // Whether the node has a block for the child, without allocating one.
+    template <uint32_t N>
+    bool has_child(thread_state<N>& thread_state, player_node<N> node, uint16_t child) {
+        uint32_t index = __atomic_load_n(&node.children, __ATOMIC_ACQUIRE);
+        if (index == (uint32_t)-1) {
+            return false;
+        }
+        child_block<N> block = get_child_block(thread_state, index, 0, node.number_of_choices);
+        while (block.block < child_block_of(child)) {
+            if (!next_child_block(thread_state, node.number_of_choices, block)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Calls visit(index, child) for every child the node has a block for.
+    template <uint32_t N, typename visit_t>
+    void for_each_child(thread_state<N>& thread_state, player_node<N> node, visit_t visit) {
+        uint32_t index = __atomic_load_n(&node.children, __ATOMIC_ACQUIRE);
+        if (index == (uint32_t)-1) {
+            return;
+        }
+        child_block<N> block = get_child_block(thread_state, index, 0, node.number_of_choices);
+        do {
+            uint16_t end = std::min<uint16_t>(block.first + block.capacity,
+                                              node.number_of_choices);
+            for (uint16_t child = block.first; child < end; child++) {
+                visit(child, block[child - block.first]);
+            }
+        } while (next_child_block(thread_state, node.number_of_choices, block));
+    }
+
+    // Brings the counts of an expanded node's first children into the
+    // cache while the caller is still busy with the move that leads there.
+    template <uint32_t N>
+    void prefetch_children(player_node<N> node, thread_state<N>& thread_state) {
+        uint32_t index = __atomic_load_n(&node.children, __ATOMIC_RELAXED);
+        if (index != (uint32_t)-1) {
+            child_block<N> block = get_child_block(thread_state, index, 0,
+                                                   node.number_of_choices);
+            __builtin_prefetch(block.simulations);
+            __builtin_prefetch(block.wins);
+        }
+    }
+
+    // b's replies at the position of node, which has first as its first
+    // block. The view shares the node's own statistics and proof, which
+    // are never updated through it.
+    template <uint32_t N>
+    player_node<N> replies_of(player_node<N> node, child_block<N> first) {
+        return player_node<N>(*first.reply_choices, *first.replies, node.simulations, node.wins,
+                              node.proof);
+    }
+
+    // Workers racing to fill in the number of replies store the same value.
+    template <uint32_t N>
+    player_node<N> get_replies(player_node<N> node, child_block<N> first, player_t& b) {
+        if (__atomic_load_n(first.reply_choices, __ATOMIC_ACQUIRE) == 0) {
+            __atomic_store_n(first.reply_choices, calculate_number_of_choices(b),
+                             __ATOMIC_RELEASE);
+        }
+        return replies_of(node, first);
+    }
+
+    // The joint table of a position is a chain of blocks, each a child
+    // block behind an array with the key of every slot. A key is claimed
+    // with a compare-and-swap and never changes after, and the node of the
+    // slot was cleared when the block was allocated. A key is looked for
+    // in a few slots from its hash in each block in turn, and given the
+    // first free one; when they are all taken it goes on to the next
+    // block, which is twice as large up to joint_block_max.
+    const uint32_t no_joint_key = (uint32_t)-1;
+    const uint8_t joint_probes = 8;
+    const uint16_t joint_block_max = child_block_base << 11;
+
+    inline uint32_t joint_key(uint16_t a_index, uint16_t b_index) {
+        return (uint32_t)a_index << 16 | b_index;
+    }
+
+    inline uint16_t joint_block_capacity(uint8_t block) {
+        return block < 11 ? child_block_base << block : joint_block_max;
+    }
+
+    inline uint32_t joint_block_bytes(uint16_t capacity) {
+        return capacity * sizeof(uint32_t) + child_block_bytes(capacity);
+    }
+
+    inline uint16_t joint_hash(uint32_t key, uint16_t capacity) {
+        return (key * 2654435761u) >> (32 - __builtin_ctz(capacity));
+    }
+
+    template <uint32_t N>
+    struct joint_block {
+        uint32_t* keys;
+        child_block<N> nodes;
+
+        joint_block(void* memory, uint8_t block, uint16_t capacity)
+            : keys(static_cast<uint32_t*>(memory)), nodes(keys + capacity, block, 0, capacity) {
+        }
+    };
+
+    template <uint32_t N>
+    joint_block<N> get_joint_block(thread_state<N>& thread_state, uint32_t index, uint8_t block) {
+        return joint_block<N>(get_buffer_by_index(thread_state, index), block,
+                              joint_block_capacity(block));
+    }
+
+    template <uint32_t N>
+    uint32_t allocate_joint_block(thread_state<N>& thread_state, uint8_t block) {
+        uint16_t capacity = joint_block_capacity(block);
+        uint32_t index = allocate_memory(thread_state, joint_block_bytes(capacity));
+        if (index == (uint32_t)-1) {
+            return index;
+        }
+        joint_block<N> joint = get_joint_block(thread_state, index, block);
+        std::memset(joint.keys, 0xff, capacity * sizeof(uint32_t));
+        clear_child_block(joint.nodes);
+        return index;
+    }
+
+    // Where a position is in the joint table.
+    struct joint_slot {
+        uint32_t index;
+        uint8_t block;
+        uint16_t slot;
     };
 
     template <uint32_t N>
-    void update_reward(player_node<N>& node,
+    player_node<N> joint_node(thread_state<N>& thread_state, joint_slot found) {
+        return get_joint_block(thread_state, found.index, found.block).nodes[found.slot];
+    }
+
+    // Looks key up in the joint table at link. With insert set a missing
+    // key is given a slot, and inserted tells whether this call did so; it
+    // is only missing then if the arena had no room for a block.
+    template <uint32_t N>
+    bool find_joint_slot(thread_state<N>& thread_state,
+                         uint32_t& link,
+                         uint32_t key,
+                         bool insert,
+                         joint_slot& found,
+                         bool& inserted) {
+        inserted = false;
+        uint32_t* next = &link;
+        for (uint8_t block = 0; ; block++) {
+            uint32_t index = __atomic_load_n(next, __ATOMIC_ACQUIRE);
+            if (index == (uint32_t)-1) {
+                if (!insert) {
+                    return false;
+                }
+                index = expand_link(*next, [&] {
+                    return allocate_joint_block(thread_state, block);
+                });
+                if (index == (uint32_t)-1) {
+                    return false;
+                }
+            }
+            joint_block<N> joint = get_joint_block(thread_state, index, block);
+            uint16_t capacity = joint.nodes.capacity;
+            uint16_t slot = joint_hash(key, capacity);
+            for (uint8_t probe = 0; probe < joint_probes; probe++) {
+                uint32_t claimed = __atomic_load_n(joint.keys + slot, __ATOMIC_ACQUIRE);
+                if (claimed == no_joint_key) {
+                    if (!insert) {
+                        return false;
+                    }
+                    inserted = __atomic_compare_exchange_n(joint.keys + slot, &claimed, key,
+                                                           false, __ATOMIC_ACQ_REL,
+                                                           __ATOMIC_ACQUIRE);
+                }
+                if (inserted || claimed == key) {
+                    found = joint_slot{index, block, slot};
+                    return true;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+            next = joint.nodes.next;
+        }
+    }
+
+    // The position reached from first's when a plays a_index and b plays
+    // b_index, given a slot on the first call, which expects the arena to
+    // have room.
+    template <uint32_t N>
+    player_node<N> get_joint_child(thread_state<N>& thread_state,
+                                   child_block<N> first,
+                                   uint16_t a_index,
+                                   uint16_t b_index,
+                                   bool& inserted) {
+        joint_slot found;
+        find_joint_slot(thread_state, *first.joint, joint_key(a_index, b_index), true, found,
+                        inserted);
+        return joint_node(thread_state, found);
+    }
+
+    template <uint32_t N>
+    bool find_joint_child(thread_state<N>& thread_state,
+                          child_block<N> first,
+                          uint16_t a_index,
+                          uint16_t b_index,
+                          joint_slot& found) {
+        bool inserted;
+        return find_joint_slot(thread_state, *first.joint, joint_key(a_index, b_index), false,
+                               found, inserted);
+    }
+
+    // A tree of its own has one writer, but the scheduler reads the root's
+    // counts while the search runs, so the counts are stored atomically
+    // there too. Relaxed stores of a value only this worker writes cost no
+    // more than plain ones.
+    template <bool Shared = false, uint32_t N>
+    void update_reward(player_node<N> node,
 //                       thread_state<N>& thread_state,
                        uint8_t won) {
 
         // player_node<N>* selected_node = node.get_children(thread_state) + selection;
         // selected_node->wins += won;
         // selected_node->simulations++;
-        node.wins += (won == 1);
-        node.simulations += (won < 10);
+        if (Shared) {
+            __atomic_fetch_add(&node.wins, (won == 1), __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_store_n(&node.wins, node.wins + (won == 1), __ATOMIC_RELAXED);
+        __atomic_store_n(&node.simulations, node.simulations + (won < 10), __ATOMIC_RELAXED);
     }
 
-    inline float uct(uint16_t node_wins, uint16_t node_simulations, uint16_t total_simulations) {
-        return ((float) node_wins / (float) node_simulations) +
-            exploration * std::sqrt(std::log(total_simulations) / node_simulations);
+    // In a shared tree the visit is counted on the way down, before the
+    // result is known. Until the reward arrives it reads as a loss, which
+    // steers the other workers towards different branches.
+    template <bool Shared, uint32_t N>
+    void add_virtual_loss(player_node<N> node) {
+        if (Shared) {
+            __atomic_fetch_add(&node.simulations, 1, __ATOMIC_RELAXED);
+        }
     }
 
+    // Nodes inside a child block were cleared when it was allocated, so
+    // the number of choices is all that is left to fill in. Workers racing to
+    // do so store the same value.
     template <uint32_t N>
-    player_node<N>* construct_player_node(player_node<N>& node, player_t& player) {
-        return new (&node) player_node<N>(player);
+    void publish_player_node(player_node<N> node, player_t& player) {
+        __atomic_store_n(&node.number_of_choices, calculate_number_of_choices(player),
+                         __ATOMIC_RELEASE);
+    }
+
+    template <uint32_t N>
+    bool is_constructed(player_node<N> node) {
+        return __atomic_load_n(&node.number_of_choices, __ATOMIC_ACQUIRE) != 0;
     }
 
     inline uint8_t count_attack_buildings(player_t& player) {
@@ -185,12 +744,11 @@ namespace bot {
 
     inline bool good_board_state(player_t& self, player_t& other,
                                  uint16_t current_turn) {
-        for (uint8_t i = 0; i < 10; i++) {
-            advance_state(0, 0, self, other, current_turn++);
-        }
+        fast_forward(self, other, current_turn, 10);
         return board_score(self) > board_score(other);
     }
 
+    CPU_CLONES
     uint8_t calculate_reward(player_t& self, player_t& other, 
                              uint8_t initial_health,
                              uint16_t current_turn) {
@@ -200,96 +758,286 @@ namespace bot {
         else return 0;
     }
 
+    // Positions reached through different move orders share one children
+    // array, which turns the tree into a DAG. The node itself stays with
+    // its parent and keeps the statistics of that parent's edge. Mirror
+    // images share too: the key is the canonical hash and every node
+    // numbers its moves as on the canonical orientation of its board.
     template <uint32_t N>
-    uint32_t select_index(player_node<N>* choices,
-                          uint16_t number_of_choices,
-                          uint32_t total_simulations) {
-
-        float best = 0.;
-        uint16_t best_index = 0;
-        uint16_t current_index = 0;
-        for (auto node = choices;
-             node != choices + number_of_choices; ++node) {
-            uint32_t simulations = node->simulations;
-            if (simulations == 0) {
-                return current_index;
-            }
-            float node_value = uct(node->wins, simulations, total_simulations);
-            if (node_value > best) {
-                best = node_value;
-                best_index = current_index;
-            }
-            current_index++;
+    void share_children(player_node<N> node,
+                        thread_state<N>& thread_state,
+                        uint64_t key,
+                        uint16_t current_turn) {
+        uint32_t children;
+        if (probe(thread_state.table, key, node.number_of_choices, children)) {
+            uint32_t expected = (uint32_t)-1;
+            __atomic_compare_exchange_n(&node.children, &expected, children, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        } else if (expand_to_child(thread_state, node, 0)) {
+            store(thread_state.table, key, node.number_of_choices, node.children, current_turn);
         }
-
-        return best_index;
     }
 
+    // Scores the children the node has blocks for. Once all of those have
+    // been visited, the first child without a block is the next to visit.
     template <uint32_t N>
-    void sm_mcts(std::mt19937& mt,
-                 uint8_t& a_reward,
-                 uint8_t& b_reward,
-                 player_node<N>& a_node,
-                 thread_state<N>& thread_state,
-                 board_t& board,
-                 uint16_t current_turn) {
-
-        uint16_t a_index = select_index(a_node.get_children(thread_state),
-                                        a_node.number_of_choices,
-                                        a_node.simulations);
+    CPU_CLONES
+    uint16_t select_index(thread_state<N>& thread_state,
+                          player_node<N> node,
+                          uint32_t total_simulations) {
+        uct_selection selection;
+        start_selection(selection, total_simulations);
+        child_block<N> block = node.get_children(thread_state);
+        uint16_t end;
+        do {
+            end = std::min<uint16_t>(block.first + block.capacity, node.number_of_choices);
+            score_children(selection, block.simulations, block.wins,
+                           block.first, end - block.first, block.proofs);
+        } while (next_child_block(thread_state, node.number_of_choices, block));
+        uint16_t child;
+        if (!selected_child(selection, child) && end < node.number_of_choices) {
+            return end;
+        }
+        return child;
+    }
 
-        assert(a_index < a_node.number_of_choices);
+    // Proofs only ever go from unproven to proven, and workers racing to
+    // prove a node prove it the same way. Returns whether this call did.
+    template <uint32_t N>
+    bool prove(player_node<N> node, uint8_t proof) {
+        uint8_t expected = unproven;
+        return __atomic_compare_exchange_n(&node.proof, &expected, proof, false,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
 
-        player_node<N>& b_node = a_node.get_children(thread_state)[a_index];
+    template <uint32_t N>
+    uint8_t load_proof(player_node<N> node) {
+        return __atomic_load_n(&node.proof, __ATOMIC_RELAXED);
+    }
 
-        if (b_node.number_of_choices == 0) {
+    // The rewards the players get from a node whose outcome is known, in
+    // the order sm_mcts hands them up: first for the node's own player.
+    inline void proven_rewards(uint8_t proof, uint8_t& a_reward, uint8_t& b_reward) {
+        a_reward = proof == proven_win;
+        b_reward = proof == proven_loss;
+    }
 
-            construct_player_node(b_node, board.b);
-            uint8_t a_initial_health = board.a.health;
-            uint8_t b_initial_health = board.b.health;
+    // The game is over once a player has no health left. The proof is for
+    // b, who chose the move leading to the next node of a.
+    inline uint8_t game_over_proof(const board_t& board) {
+        if (board.a.health > 0 && board.b.health > 0) {
+            return unproven;
+        }
+        if (board.a.health > 0) {
+            return proven_loss;
+        } else if (board.b.health > 0) {
+            return proven_win;
+        }
+        return proven_draw;
+    }
 
-            uint16_t a_move = decode_move(a_index, board.a, a_node.number_of_choices);
+    // Whether the position of first was reached with every pair
+    // key_of(i), i < count, and those reached all have the given proof.
+    template <uint32_t N, typename key_t>
+    bool all_pairs_proven(thread_state<N>& thread_state,
+                          child_block<N> first,
+                          uint16_t count,
+                          uint8_t proof,
+                          key_t key_of) {
+        for (uint16_t i = 0; i < count; i++) {
+            joint_slot found;
+            bool inserted;
+            if (!find_joint_slot(thread_state, *first.joint, key_of(i), false, found, inserted)
+                || load_proof(joint_node(thread_state, found)) != proof) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-            uint16_t b_index = mt() % b_node.number_of_choices;
-            uint16_t b_move = decode_move(b_index, board.b, b_node.number_of_choices);
+    // Moves are simultaneous, so a choice is only decided by those of the
+    // other player if they all agree: a_index wins for a when every reply
+    // of b leads to a loss for b, and loses when every one leads to a win,
+    // and the same goes for b_index against every choice of a. The
+    // position is then won for a player as soon as one of their choices
+    // is. Called when the position reached by a_index and b_index has just
+    // been proven, for b; returns whether node was proven with it.
+    template <uint32_t N>
+    bool propagate_proof(thread_state<N>& thread_state,
+                         player_node<N> node,
+                         child_block<N> first,
+                         player_node<N> a_choice,
+                         player_node<N> b_choice,
+                         uint16_t a_index,
+                         uint16_t b_index,
+                         uint8_t proof) {
+        if (proof != proven_win && proof != proven_loss) {
+            return false;
+        }
+        uint8_t a_proof = proof == proven_win ? proven_loss : proven_win;
+        bool a_decided = all_pairs_proven(thread_state, first, *first.reply_choices, proof,
+                                          [a_index](uint16_t b) {
+                                              return joint_key(a_index, b);
+                                          });
+        bool b_decided = all_pairs_proven(thread_state, first, node.number_of_choices, proof,
+                                          [b_index](uint16_t a) {
+                                              return joint_key(a, b_index);
+                                          });
+        if (a_decided) {
+            prove(a_choice, a_proof);
+        }
+        if (b_decided) {
+            prove(b_choice, proof);
+        }
+        if (a_decided && a_proof == proven_win) {
+            return prove(node, proven_loss);
+        }
+        if (b_decided && proof == proven_win) {
+            return prove(node, proven_win);
+        }
+        return false;
+    }
 
-            uint16_t final_turn = simulate(mt, board.a, board.b, a_move, b_move, current_turn);
+    // Plays a rollout from board that starts with a_move and b_move, and
+    // sets the rewards as sm_mcts hands them up.
+    template <typename rng_t>
+    void roll_out(rng_t& rng,
+                  uint8_t& a_reward,
+                  uint8_t& b_reward,
+                  board_t& board,
+                  uint16_t a_move,
+                  uint16_t b_move,
+                  uint16_t current_turn,
+                  const rollout_policy& policy) {
+        uint8_t a_initial_health = board.a.health;
+        uint8_t b_initial_health = board.b.health;
+        uint16_t final_turn = simulate(rng, board.a, board.b, a_move, b_move, current_turn,
+                                       policy.horizon);
+        if (is_cut_off(policy, board)) {
+            judge_cut_off(rng, policy, board, a_reward, b_reward);
+        } else {
             a_reward = calculate_reward(board.b, board.a, a_initial_health, final_turn);
-
-            update_reward(a_node, a_reward);
-
             b_reward = calculate_reward(board.a, board.b, b_initial_health, final_turn);
+        }
+    }
 
-            update_reward(b_node, b_reward);
+    // Ends a descent that found no room in the arena to expand node with a
+    // rollout from its position, with both first moves picked at random.
+    template <bool Shared, uint32_t N, typename rng_t>
+    bool roll_out_unexpanded(rng_t& rng,
+                             uint8_t& a_reward,
+                             uint8_t& b_reward,
+                             player_node<N> node,
+                             board_t& board,
+                             uint16_t current_turn,
+                             const rollout_policy& policy) {
+        bool mirrored = is_mirrored(board);
+        uint16_t b_choices = calculate_number_of_choices(board.b);
+        uint16_t a_move = cached_move(rng() % node.number_of_choices, board.a,
+                                      node.number_of_choices, mirrored);
+        uint16_t b_move = cached_move(rng() % b_choices, board.b, b_choices, mirrored);
+        roll_out(rng, a_reward, b_reward, board, a_move, b_move, current_turn, policy);
+        update_reward<Shared>(node, a_reward);
+        return false;
+    }
 
-        } else {
+    // Both players pick from their own statistics at the position of
+    // node. The first visit of a pair is a rollout from there, and later
+    // ones descend into the position it reaches. Shared is set when
+    // several workers descend the same tree. Returns whether node was
+    // proven on the way.
+    template <bool Shared, uint32_t N, typename rng_t>
+    bool sm_mcts(rng_t& rng,
+                 uint8_t& a_reward,
+                 uint8_t& b_reward,
+                 player_node<N> node,
+                 thread_state<N>& thread_state,
+                 board_t& board,
+                 uint16_t current_turn,
+                 const rollout_policy& policy) {
+
+        add_virtual_loss<Shared>(node);
+        uint8_t proof = load_proof(node);
+        if (proof != unproven) {
+            proven_rewards(proof, a_reward, b_reward);
+            update_reward<Shared>(node, a_reward);
+            return false;
+        }
 
-            uint16_t b_index = select_index(b_node.get_children(thread_state),
-                                            b_node.number_of_choices,
-                                            b_node.simulations);
+        bool mirrored = is_mirrored(board);
+        uint32_t total_simulations = __atomic_load_n(&node.simulations, __ATOMIC_RELAXED);
+        if (!expand_to_child(thread_state, node, 0)) {
+            return roll_out_unexpanded<Shared>(rng, a_reward, b_reward, node, board,
+                                               current_turn, policy);
+        }
+        child_block<N> first = node.get_children(thread_state);
+        player_node<N> replies = get_replies(node, first, board.b);
+        if (!expand_to_child(thread_state, replies, 0)) {
+            return roll_out_unexpanded<Shared>(rng, a_reward, b_reward, node, board,
+                                               current_turn, policy);
+        }
+        uint16_t a_index = select_index(thread_state, node, total_simulations);
+        uint16_t b_index = select_index(thread_state, replies, total_simulations);
+
+        assert(a_index < node.number_of_choices);
+        assert(b_index < replies.number_of_choices);
+
+        joint_slot found;
+        bool inserted;
+        if (!expand_to_child(thread_state, node, a_index)
+            || !expand_to_child(thread_state, replies, b_index)
+            || !find_joint_slot(thread_state, *first.joint, joint_key(a_index, b_index), true,
+                                found, inserted)) {
+            return roll_out_unexpanded<Shared>(rng, a_reward, b_reward, node, board,
+                                               current_turn, policy);
+        }
+        player_node<N> a_choice = get_child(thread_state, node, a_index);
+        player_node<N> b_choice = get_child(thread_state, replies, b_index);
+        add_virtual_loss<Shared>(a_choice);
+        add_virtual_loss<Shared>(b_choice);
+        player_node<N> next_node = joint_node(thread_state, found);
+        prefetch_children(next_node, thread_state);
+        uint16_t a_move = cached_move(a_index, board.a, node.number_of_choices, mirrored);
+        uint16_t b_move = cached_move(b_index, board.b, replies.number_of_choices, mirrored);
+        bool proven = false;
+
+        if (inserted) {
+
+            add_virtual_loss<Shared>(next_node);
+            roll_out(rng, a_reward, b_reward, board, a_move, b_move, current_turn, policy);
+            update_reward<Shared>(next_node, a_reward);
 
-            assert(b_index < b_node.number_of_choices);
+        } else {
 
-            uint16_t a_move = decode_move(a_index, board.a, a_node.number_of_choices);
-            uint16_t b_move = decode_move(b_index, board.b, b_node.number_of_choices);
             advance_state(a_move, b_move, board.a, board.b, current_turn);
-            assert(a_index >= 0 && a_index < a_node.number_of_choices);
-            player_node<N>& next_a_node = b_node.get_children(thread_state)[b_index];
-            if (next_a_node.number_of_choices == 0) {
-                construct_player_node(next_a_node, board.a);
+            uint8_t game_over = game_over_proof(board);
+            bool next_proven = game_over != unproven && prove(next_node, game_over);
+            if (game_over == unproven && !is_constructed(next_node)) {
+                publish_player_node(next_node, board.a);
+                share_children(next_node, thread_state,
+                               canonical_board_hash(board, current_turn + 1), current_turn + 1);
+            }
+            next_proven |= sm_mcts<Shared>(rng,
+                                           a_reward,
+                                           b_reward,
+                                           next_node,
+                                           thread_state,
+                                           board,
+                                           current_turn + 1,
+                                           policy);
+            if (next_proven) {
+                proven = propagate_proof(thread_state, node, first, a_choice, b_choice,
+                                         a_index, b_index, load_proof(next_node));
             }
-            sm_mcts(mt,
-                    a_reward,
-                    b_reward,
-                    next_a_node,
-                    thread_state,
-                    board,
-                    current_turn + 1);
+        }
 
-            update_reward(a_node, a_reward);
+        update_reward<Shared>(node, a_reward);
 
-            update_reward(b_node, b_reward);
-        }
+        update_reward<Shared>(a_choice, b_reward);
+
+        update_reward<Shared>(b_choice, a_reward);
+
+        return proven;
     }
 
     uint64_t find_attack_buildings(player_t& player) {
@@ -312,41 +1060,232 @@ namespace bot {
         return 65;
     }
 
+    // One worker's tree together with the position at its root. In daemon
+    // mode it outlives the round it was built in. The root's block lives
+    // here rather than in the arena, so that a tree always has a root even
+    // when the arena has no memory for it.
     template <uint32_t N>
-    void mcts_find_best_move(std::atomic<bool>& stop_search,
-                             board_t initial_board,
-                             player_node<N>* choices,
-                             uint16_t current_turn) {
-        std::mt19937 mt(time(0));
-        std::uniform_real_distribution<float> uniform_distribution(0.0, 1.0);
-        std::unique_ptr<thread_state<N>> memory(new thread_state<N>());
-        uint32_t a_index = allocate_memory(*memory, sizeof(player_node<N>));
-        player_node<N>* a_root =
-            static_cast<player_node<N>*>(get_buffer_by_index(*memory, a_index));
-        construct_player_node(*a_root, initial_board.a);
+    struct search_tree {
+        std::unique_ptr<thread_state<N>> memory;
+        alignas(64) uint8_t root_block[256];
+        board_t board;
+        uint16_t turn;
+        rollout_policy policy;
+
+        search_tree() : memory(new thread_state<N>()), turn(0), policy(full_rollouts) {
+            static_assert(sizeof(root_block) >= child_block_bytes(child_block_base),
+                          "the root block holds one block of children");
+            clear_child_block(child_block<N>(root_block, 0, 0, child_block_base));
+        }
+    };
+
+    template <uint32_t N>
+    player_node<N> root_node(search_tree<N>& tree) {
+        return child_block<N>(tree.root_block, 0, 0, child_block_base)[0];
+    }
+
+    template <uint32_t N>
+    void reset_tree(search_tree<N>& tree, board_t& board, uint16_t current_turn) {
+        thread_state<N>& memory = *tree.memory;
+        memory.buffer_index = 0;
+        reset_arena(memory.buffer[0]);
+        clear_table(memory.table);
+        clear_child_block(child_block<N>(tree.root_block, 0, 0, child_block_base));
+        root_node(tree).number_of_choices = calculate_number_of_choices(board.a);
+        copy_board(board, tree.board);
+        tree.turn = current_turn;
+    }
+
+    // Copies a chain of child blocks that holds statistics only. The copy
+    // functions clear room and stop copying when the arena runs out.
+    template <uint32_t N>
+    uint32_t copy_child_blocks(thread_state<N>& memory,
+                               uint32_t children,
+                               uint16_t number_of_choices,
+                               bool& room) {
+        uint32_t copy = (uint32_t)-1;
+        uint32_t* link = &copy;
+        uint8_t block = 0;
+        for (uint32_t index = children; index != (uint32_t)-1; block++) {
+            uint32_t bytes = child_block_bytes(child_block_size(block, number_of_choices));
+            *link = allocate_memory(memory, bytes);
+            if (*link == (uint32_t)-1) {
+                room = false;
+                break;
+            }
+            std::memcpy(get_buffer_by_index(memory, *link), get_buffer_by_index(memory, index),
+                        bytes);
+            child_block<N> target = get_child_block(memory, *link, block, number_of_choices);
+            index = *target.next;
+            *target.next = (uint32_t)-1;
+            link = target.next;
+        }
+        return copy;
+    }
+
+    template <uint32_t N>
+    uint32_t copy_children(thread_state<N>& memory,
+                           uint32_t children,
+                           uint16_t number_of_choices,
+                           std::unordered_map<uint32_t, uint32_t>& copied,
+                           bool& room);
+
+    // Copies a joint table along with the positions in it.
+    template <uint32_t N>
+    uint32_t copy_joint_blocks(thread_state<N>& memory,
+                               uint32_t joint,
+                               std::unordered_map<uint32_t, uint32_t>& copied,
+                               bool& room) {
+        uint32_t copy = (uint32_t)-1;
+        uint32_t* link = &copy;
+        uint8_t block = 0;
+        for (uint32_t index = joint; room && index != (uint32_t)-1; block++) {
+            uint32_t bytes = joint_block_bytes(joint_block_capacity(block));
+            *link = allocate_memory(memory, bytes);
+            if (*link == (uint32_t)-1) {
+                room = false;
+                break;
+            }
+            std::memcpy(get_buffer_by_index(memory, *link), get_buffer_by_index(memory, index),
+                        bytes);
+            joint_block<N> target = get_joint_block(memory, *link, block);
+            child_block<N>& nodes = target.nodes;
+            for (uint16_t i = 0; i < nodes.capacity; i++) {
+                if (target.keys[i] != no_joint_key && nodes.number_of_choices[i] != 0
+                    && nodes.children[i] != (uint32_t)-1) {
+                    nodes.children[i] = copy_children(memory, nodes.children[i],
+                                                      nodes.number_of_choices[i], copied, room);
+                }
+            }
+            index = *nodes.next;
+            *nodes.next = (uint32_t)-1;
+            link = nodes.next;
+        }
+        return copy;
+    }
+
+    // Copies the children of a position together with its replies and
+    // joint table. Children shared through the transposition table are
+    // copied once and stay shared in the copy.
+    template <uint32_t N>
+    uint32_t copy_children(thread_state<N>& memory,
+                           uint32_t children,
+                           uint16_t number_of_choices,
+                           std::unordered_map<uint32_t, uint32_t>& copied,
+                           bool& room) {
+        auto found = copied.find(children);
+        if (found != copied.end()) {
+            return found->second;
+        }
+        uint32_t copy = copy_child_blocks(memory, children, number_of_choices, room);
+        if (copy == (uint32_t)-1) {
+            return copy;
+        }
+        copied[children] = copy;
+        child_block<N> first = get_child_block(memory, copy, 0, number_of_choices);
+        *first.replies = copy_child_blocks(memory, *first.replies, *first.reply_choices, room);
+        *first.joint = copy_joint_blocks(memory, *first.joint, copied, room);
+        return copy;
+    }
+
+    // Copies the subtree below node into the unused half of the buffer and
+    // makes it the root. Everything else in the old half is dropped, and
+    // so is the transposition table, which points into it. Returns false
+    // if the arena ran out before the copy was done, which leaves the tree
+    // to be reset.
+    template <uint32_t N>
+    bool promote_root(search_tree<N>& tree, player_node<N> node) {
+        thread_state<N>& memory = *tree.memory;
+        memory.buffer_index ^= 1;
+        reset_arena(memory.buffer[memory.buffer_index]);
+        clear_table(memory.table);
+        std::unordered_map<uint32_t, uint32_t> copied;
+        bool room = true;
+        uint32_t children = (uint32_t)-1;
+        if (node.children != (uint32_t)-1) {
+            children = copy_children(memory, node.children, node.number_of_choices, copied, room);
+        }
+        player_node<N> root = root_node(tree);
+        root.number_of_choices = node.number_of_choices;
+        root.simulations = node.simulations;
+        root.wins = node.wins;
+        root.proof = node.proof;
+        root.children = children;
+        return room;
+    }
+
+    // Moves the root one turn forward after we played a_index, which
+    // leaves the opponent's move to be found: every reply that was played
+    // against a_index is replayed from the old root and compared with the position that
+    // was actually reached. Returns false if none of them matches or the
+    // subtree does not fit, in which case the tree has to be reset.
+    template <uint32_t N>
+    bool advance_tree(search_tree<N>& tree,
+                      uint16_t a_index,
+                      board_t& board,
+                      uint16_t current_turn) {
+        if (root_node(tree).number_of_choices == 0 || current_turn != tree.turn + 1) {
+            return false;
+        }
+        player_node<N> a_root = root_node(tree);
+        if (a_index >= a_root.number_of_choices || a_root.children == (uint32_t)-1) {
+            return false;
+        }
+        child_block<N> first = get_child_block(*tree.memory, a_root.children, 0,
+                                               a_root.number_of_choices);
+        uint16_t b_choices = *first.reply_choices;
+        uint64_t reached = board_hash(board, current_turn);
+        bool mirrored = is_mirrored(tree.board);
+        uint16_t a_move = decode_move(a_index, tree.board.a, a_root.number_of_choices, mirrored);
+        for (uint16_t b_index = 0; b_index < b_choices; b_index++) {
+            joint_slot found;
+            if (!find_joint_child(*tree.memory, first, a_index, b_index, found)) {
+                continue;
+            }
+            player_node<N> reply = joint_node(*tree.memory, found);
+            if (reply.number_of_choices == 0) {
+                continue;
+            }
+            board_t played;
+            copy_board(tree.board, played);
+            uint16_t b_move = decode_move(b_index, played.b, b_choices, mirrored);
+            advance_state(a_move, b_move, played.a, played.b, tree.turn);
+            if (board_hash(played, current_turn) == reached) {
+                if (!promote_root(tree, reply)) {
+                    return false;
+                }
+                copy_board(board, tree.board);
+                tree.turn = current_turn;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <bool Shared = false, uint32_t N, typename rng_t>
+    uint64_t grow_tree(rng_t& rng,
+                       search_tree<N>& tree,
+                       std::atomic<bool>& stop_search,
+                       uint64_t iterations) {
+        player_node<N> a_root = root_node(tree);
         uint8_t a_reward = 0.;
         uint8_t b_reward = 0.;
-        bool done = true;
-        while (!stop_search.compare_exchange_weak(done, done)) {
-            done = true;
+        uint64_t iterations_done = 0;
+        while (!stop_search.load(std::memory_order_relaxed)
+               && (iterations == 0 || iterations_done < iterations)
+               && tree_has_room(*tree.memory)) {
+            iterations_done++;
             board_t board_copy;
-            copy_board(initial_board, board_copy);
-            sm_mcts(mt, a_reward,
-                    b_reward, *a_root, *memory, board_copy, current_turn);
+            copy_board(tree.board, board_copy);
+            sm_mcts<Shared>(rng, a_reward,
+                            b_reward, a_root, *tree.memory, board_copy, tree.turn, tree.policy);
         }
-        std::memcpy(choices, a_root->get_children(*memory),
-                    a_root->number_of_choices * sizeof(player_node<N>));
+        return iterations_done;
     }
 
     uint16_t read_board(board_t& board, std::string& state_path) {
         std::memset(&board, 0, sizeof(board));
-        std::ifstream state_reader(state_path, std::ios::in);
-        if (state_reader.is_open()) {
-            json game_state_json;
-            state_reader >> game_state_json;
-            return read_from_state(board.a, board.b, game_state_json);
-        }
-        return -1;
+        return load_state_file(board.a, board.b, state_path);
     }
 
     void write_to_file(uint8_t row,
@@ -367,122 +1306,317 @@ namespace bot {
         }
     }
 
+    // The first turns are played by a fixed rule instead of a search.
+    bool write_opening_move(board_t& board, uint16_t current_turn) {
+        if (current_turn < 13) {
+            if (board.a.energy < 20) {
+                write_to_file(0, 0, 0);
+                return true;
+            }
+            uint8_t energy_building_row = find_energy_building_row(board);
+            if (energy_building_row < 64) {
+                write_to_file(energy_building_row, 0, 3);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void write_choice(board_t& board, uint16_t choice, uint16_t number_of_choices) {
+        uint16_t move = decode_move(choice, board.a, number_of_choices, is_mirrored(board));
+        uint8_t position = move >> 3;
+        assert(position >= 0 && position < 64);
+        uint8_t building_num = move & 7;
+        uint8_t row = position >> 3;
+        uint8_t col = position & 7;
+        write_to_file(row, col, building_num);
+    }
+
     template <uint32_t N>
-    void combine_choices(player_node<N>* aggregate,
-                         player_node<N>* thread_rewards,
-                         uint16_t number_of_choices,
+    void combine_choices(uint32_t* simulations,
+                         uint32_t* wins,
+                         thread_state<N>& thread_state,
+                         player_node<N> root,
                          uint32_t& total_simulations) {
-        player_node<N> *aggregate_it, *thread_it;
-        for (aggregate_it = aggregate, thread_it = thread_rewards;
-             aggregate_it != aggregate + number_of_choices; (aggregate_it++, thread_it++)) {
-            aggregate_it->wins += thread_it->wins;
-            aggregate_it->simulations += thread_it->simulations;
-            total_simulations += thread_it->simulations;
+        for_each_child(thread_state, root, [&](uint16_t i, player_node<N> child) {
+            wins[i] += child.wins;
+            simulations[i] += child.simulations;
+            total_simulations += child.simulations;
+        });
+    }
+
+    uint16_t most_visited(const uint32_t* simulations, uint16_t number_of_choices) {
+        uint16_t best = 0;
+        for (uint16_t i = 1; i < number_of_choices; i++) {
+            if (simulations[i] > simulations[best]) {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // A move proven to win is played whatever its visits, and one proven
+    // to lose only when every move is.
+    uint16_t most_visited(const uint32_t* simulations,
+                          const uint8_t* proofs,
+                          uint16_t number_of_choices) {
+        uint16_t best = number_of_choices;
+        for (uint16_t i = 0; i < number_of_choices; i++) {
+            if (proofs[i] == proven_win) {
+                return i;
+            }
+            if (proofs[i] != proven_loss
+                && (best == number_of_choices || simulations[i] > simulations[best])) {
+                best = i;
+            }
+        }
+        return best < number_of_choices ? best : most_visited(simulations, number_of_choices);
+    }
+
+    void print_table_stats(const transposition_stats* stats, uint8_t workers) {
+        transposition_stats total = {};
+        for (uint8_t i = 0; i < workers; i++) {
+            total.hits += stats[i].hits;
+            total.misses += stats[i].misses;
+            total.collisions += stats[i].collisions;
+        }
+        std::cout << "transpositions hits " << total.hits << " misses " << total.misses
+                  << " collisions " << total.collisions << std::endl;
+    }
+
+    void print_memory_stats() {
+        memory_budget_t& budget = memory_budget();
+        std::cout << "memory high water " << (budget.high_water.load() >> 20) << " MB of "
+                  << (budget.limit.load() >> 20) << " MB" << std::endl;
+    }
+
+    // Search tasks and the trees they grow, kept together so that a daemon
+    // can carry them from one round to the next. Each task has its own
+    // random stream and, unless options.tree_parallel puts them all on
+    // trees[0], its own tree.
+    template <uint32_t N, typename rng_t = search_rng_t>
+    struct search_workers {
+        search_options options;
+        worker_pool pool;
+        uint8_t workers;
+        std::vector<search_tree<N>> trees;
+        std::vector<rng_t> rngs;
+        std::vector<uint64_t> iterations;
+        std::atomic<bool> stop_search;
+        uint64_t visits_at_start;
+
+        explicit search_workers(const search_options& options)
+            : options(options),
+              pool(search_thread_count(options)),
+              workers(search_tasks(options, pool.size)),
+              trees(options.tree_parallel ? 1 : workers),
+              rngs(workers),
+              iterations(workers),
+              stop_search(false),
+              visits_at_start(0) {
+            for (search_tree<N>& tree : trees) {
+                tree.policy.horizon = options.horizon;
+            }
+        }
+    };
+
+    template <uint32_t N, typename rng_t>
+    uint8_t tree_count(const search_workers<N, rng_t>& workers) {
+        return workers.trees.size();
+    }
+
+    template <uint32_t N, typename rng_t>
+    void start_workers(search_workers<N, rng_t>& workers, uint64_t seed) {
+        for (uint8_t i = 0; i < workers.workers; i++) {
+            seed_worker(workers.rngs[i], seed, i);
         }
+        start_pool(workers.pool);
+    }
+
+    template <uint32_t N, typename rng_t>
+    void stop_workers(search_workers<N, rng_t>& workers) {
+        stop_pool(workers.pool);
+    }
+
+    // Root visits summed over the trees. The counts are read while the
+    // workers update them, and a root nobody has expanded yet is skipped
+    // rather than expanded from this thread.
+    template <uint32_t N, typename rng_t>
+    uint64_t sum_root_visits(search_workers<N, rng_t>& workers, std::vector<uint64_t>& visits) {
+        uint64_t total = 0;
+        for (search_tree<N>& tree : workers.trees) {
+            for_each_child(*tree.memory, root_node(tree), [&](uint16_t i, player_node<N> child) {
+                uint32_t simulations = __atomic_load_n(&child.simulations, __ATOMIC_RELAXED);
+                visits[i] += simulations;
+                total += simulations;
+            });
+        }
+        return total;
+    }
+
+    // The move played is a proven win if there is one, and otherwise the
+    // most visited one not proven lost, so it is settled once the runner-up
+    // could not catch up even if every iteration left went its way. The
+    // iterations left are extrapolated from the rate so far.
+    template <uint32_t N, typename rng_t>
+    bool leader_is_settled(search_workers<N, rng_t>& workers,
+                           search_clock_t::duration elapsed,
+                           search_clock_t::duration remaining) {
+        std::vector<uint64_t> visits(root_node(workers.trees[0]).number_of_choices, 0);
+        if (visits.size() == 1) {
+            return true;
+        }
+        for (search_tree<N>& tree : workers.trees) {
+            if (load_proof(root_node(tree)) != unproven) {
+                return true;
+            }
+        }
+        uint64_t total = sum_root_visits(workers, visits) - workers.visits_at_start;
+        bool proven_win_found = false;
+        for (search_tree<N>& tree : workers.trees) {
+            for_each_child(*tree.memory, root_node(tree), [&](uint16_t i, player_node<N> child) {
+                uint8_t proof = load_proof(child);
+                proven_win_found |= proof == proven_win;
+                visits[i] = proof == proven_loss ? 0 : visits[i];
+            });
+        }
+        if (proven_win_found) {
+            return true;
+        }
+        if (total == 0 || elapsed.count() <= 0) {
+            return false;
+        }
+        std::partial_sort(visits.begin(), visits.begin() + 2, visits.end(),
+                          std::greater<uint64_t>());
+        double visits_left = (double)total * remaining.count() / elapsed.count();
+        return visits[0] - visits[1] > visits_left;
+    }
+
+    // Grows the trees from their current roots until the deadline counted
+    // from start, or until the leading move is settled.
+    template <uint32_t N, typename rng_t>
+    void search_round(search_workers<N, rng_t>& workers, search_clock_t::time_point start) {
+        std::vector<uint64_t> visits(root_node(workers.trees[0]).number_of_choices, 0);
+        workers.visits_at_start = sum_root_visits(workers, visits);
+        workers.stop_search.store(false, std::memory_order_relaxed);
+        for (uint8_t i = 0; i < workers.workers; i++) {
+            submit(workers.pool, [&workers, i] {
+                uint64_t iterations = worker_iterations(workers.options, i);
+                if (workers.options.tree_parallel) {
+                    workers.iterations[i] = grow_tree<true>(workers.rngs[i], workers.trees[0],
+                                                            workers.stop_search, iterations);
+                } else {
+                    workers.iterations[i] = grow_tree(workers.rngs[i], workers.trees[i],
+                                                      workers.stop_search, iterations);
+                }
+            });
+        }
+        run_until_deadline(workers.pool, workers.options, workers.stop_search, start,
+                           [&workers](search_clock_t::duration elapsed,
+                                      search_clock_t::duration remaining) {
+                               return leader_is_settled(workers, elapsed, remaining);
+                           });
+    }
+
+    template <uint32_t N, typename rng_t>
+    uint16_t choose_root_move(search_workers<N, rng_t>& workers) {
+        uint16_t number_of_choices = root_node(workers.trees[0]).number_of_choices;
+        std::vector<uint32_t> simulations(number_of_choices, 0);
+        std::vector<uint32_t> wins(number_of_choices, 0);
+        std::vector<uint8_t> proofs(number_of_choices, unproven);
+        uint32_t total_simulations = 0;
+        std::vector<transposition_stats> stats(tree_count(workers));
+        for (uint8_t i = 0; i < tree_count(workers); i++) {
+            search_tree<N>& tree = workers.trees[i];
+            combine_choices(simulations.data(),
+                            wins.data(),
+                            *tree.memory,
+                            root_node(tree),
+                            total_simulations);
+            for_each_child(*tree.memory, root_node(tree),
+                           [&](uint16_t choice, player_node<N> child) {
+                uint8_t proof = load_proof(child);
+                proofs[choice] = proof != unproven ? proof : proofs[choice];
+            });
+            stats[i] = table_stats(tree.memory->table);
+        }
+        print_table_stats(stats.data(), tree_count(workers));
+        print_memory_stats();
+        return most_visited(simulations.data(), proofs.data(), number_of_choices);
     }
 
     template <uint32_t N>
-    void find_best_move_and_write_to_file()  {
+    void find_best_move_and_write_to_file(const search_options& options = search_options())  {
         board_t board;
         std::string state_path("state.json");
         uint16_t current_turn = read_board(board, state_path);
-        uint16_t number_of_choices = calculate_number_of_choices(board.a);
-        std::unique_ptr<player_node<N>[]>
-            aggregate_choices(new player_node<N>[number_of_choices]);
-        for (auto it = &(aggregate_choices[0]);
-             it != &(aggregate_choices[number_of_choices]); it++) {
-            new (it) player_node<N>();
+        if (write_opening_move(board, current_turn) || current_turn == (uint16_t) -1) {
+            return;
         }
-        if (current_turn < 13) {
-            if (board.a.energy < 20) {
-                write_to_file(0, 0, 0);
-                return;
+        uint64_t seed = options.seeded ? options.seed : fresh_seed();
+        std::unique_ptr<search_workers<N>> workers(new search_workers<N>(options));
+        start_workers(*workers, seed);
+        for (search_tree<N>& tree : workers->trees) {
+            reset_tree(tree, board, current_turn);
+        }
+        search_round(*workers, process_start);
+        stop_workers(*workers);
+        print_replay_line(seed, workers->iterations.data(), workers->workers);
+        write_choice(board, choose_root_move(*workers), calculate_number_of_choices(board.a));
+    }
+
+    // Blocks until state_path holds a complete state for a round other
+    // than last_turn. A file caught halfway through being written fails
+    // to parse and is simply read again.
+    uint16_t wait_for_state(const std::string& state_path, uint16_t last_turn, board_t& board) {
+        std::string text;
+        for (;;) {
+            if (read_file(state_path, text)) {
+                std::memset(&board, 0, sizeof(board));
+                uint16_t current_turn = load_state(board.a, board.b,
+                                                   text.data(), text.data() + text.size());
+                if (current_turn != (uint16_t) -1 && current_turn != last_turn) {
+                    return current_turn;
+                }
             }
-            uint8_t energy_building_row = find_energy_building_row(board);
-            if (energy_building_row < 64) {
-                write_to_file(energy_building_row, 0, 3);
-                return;
-            }
-        }
-        std::atomic<bool> stop_search(false);
-        if (current_turn != (uint16_t) -1) {
-            player_node<N>* choices1 =
-                new player_node<N>[number_of_choices];
-            player_node<N>* choices2 =
-                new player_node<N>[number_of_choices];
-            player_node<N>* choices3 =
-                new player_node<N>[number_of_choices];
-            player_node<N>* choices4 =
-                new player_node<N>[number_of_choices];
-
-            std::thread thr1(mcts_find_best_move<N>,
-                             std::ref(stop_search),
-                             board,
-                             choices1,
-                             current_turn);
-
-            std::thread thr2(mcts_find_best_move<N>,
-                             std::ref(stop_search),
-                             board,
-                             choices2,
-                             current_turn);
-
-            std::thread thr3(mcts_find_best_move<N>,
-                             std::ref(stop_search),
-                             board,
-                             choices3,
-                             current_turn);
-
-            std::thread thr4(mcts_find_best_move<N>,
-                             std::ref(stop_search),
-                             board,
-                             choices4,
-                             current_turn);
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(1900));
-            stop_search.store(true);
-            thr1.join();
-            thr2.join();
-            thr3.join();
-            thr4.join();
-
-
-            uint32_t total_simulations = 0;
-
-            combine_choices(&(aggregate_choices[0]),
-                            choices1,
-                            number_of_choices,
-                            total_simulations);
-            combine_choices(&(aggregate_choices[0]),
-                            choices2,
-                            number_of_choices,
-                            total_simulations);
-            combine_choices(&(aggregate_choices[0]),
-                            choices3,
-                            number_of_choices,
-                            total_simulations);
-            combine_choices(&(aggregate_choices[0]),
-                            choices4,
-                            number_of_choices,
-                            total_simulations);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
 
-            uint16_t number_of_choices = calculate_number_of_choices(board.a);
-
-            uint16_t index_of_max_reward =
-                select_index(&(aggregate_choices[0]), number_of_choices, total_simulations);
-            delete[] choices1;
-            delete[] choices2;
-            delete[] choices3;
-            delete[] choices4;
-            uint16_t move = decode_move(index_of_max_reward,
-                                        board.a, number_of_choices);
-
-            uint8_t position = move >> 3;
-            assert(position >= 0 && position < 64);
-            uint8_t building_num = move & 7;
-            uint8_t row = position >> 3;
-            uint8_t col = position & 7;
-            write_to_file(row, col, building_num);
+    // Plays every round of a game from one process: waits for each new
+    // state.json and, where the moves both players made can be found in
+    // a worker's tree, keeps searching from that subtree. The deadline
+    // counts from the moment the new state was read.
+    template <uint32_t N>
+    void run_daemon(const search_options& options) {
+        std::unique_ptr<search_workers<N>> workers(new search_workers<N>(options));
+        start_workers(*workers, options.seeded ? options.seed : fresh_seed());
+        std::string state_path("state.json");
+        uint16_t last_turn = (uint16_t) -1;
+        uint16_t last_choice = (uint16_t) -1;
+        for (;;) {
+            board_t board;
+            uint16_t current_turn = wait_for_state(state_path, last_turn, board);
+            search_clock_t::time_point round_start = search_clock_t::now();
+            uint16_t played_choice = last_choice;
+            last_turn = current_turn;
+            last_choice = (uint16_t) -1;
+            if (write_opening_move(board, current_turn)) {
+                continue;
+            }
+            uint8_t reused = 0;
+            for (search_tree<N>& tree : workers->trees) {
+                if (advance_tree(tree, played_choice, board, current_turn)) {
+                    reused++;
+                } else {
+                    reset_tree(tree, board, current_turn);
+                }
+            }
+            search_round(*workers, round_start);
+            std::cout << "round " << current_turn << " reused " << (int)reused << " of "
+                      << (int)tree_count(*workers) << " trees" << std::endl;
+            last_choice = choose_root_move(*workers);
+            write_choice(board, last_choice, calculate_number_of_choices(board.a));
         }
     }
 
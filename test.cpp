@@ -1,22 +1,821 @@
 #include "search.hpp"
 #include <gtest/gtest.h>
+#include <set>
 
 
 namespace bot {
 
-    std::string state_path("test_state.json");
+    std::string state_path("old_state.json");
 
-    TEST(Initialisation, CreatesUniformDistribution) {
+    // The game of state_path is decided within a turn, which the search
+    // proves before long and then stops descending, so trees are grown
+    // from a game that is still open.
+    std::string open_state_path("not_move_state.json");
+
+    // Every state file, for the tests that replay games from each of them.
+    const char* state_paths[] = {"old_state.json", "not_move_state.json",
+                                 "wrong_building_state.json"};
+
+    uint16_t random_legal_move(std::mt19937& mt, player_t& player) {
+        uint16_t number_of_choices = calculate_number_of_choices(player);
+        return decode_move(mt() % number_of_choices, player, number_of_choices);
+    }
+
+    TEST(Initialisation, CountsChoicesForEveryFreeCell) {
         board_t board;
         bot::read_board(board, state_path);
-        free_memory<100000> memory;
-        tree_node<100000> node(board.a, board.b, memory);
-        std::cout << "size of node " << sizeof(tree_node<100000>) << std::endl;
-        std::cout << "size of float " << sizeof(float) << std::endl;
-        ASSERT_EQ(node.number_of_choices, 65 * 65);
+        ASSERT_EQ(calculate_number_of_choices(board.a), 4 * 23 + 1);
+    }
+
+    TEST(AdvanceStateBatch, MatchesScalarAdvanceStateInEveryLane) {
+        board_t initial;
+        bot::read_board(initial, state_path);
+        board_t boards[batch_width];
+        board_batch_t batch;
+        std::mt19937 mt(7);
+        for (uint8_t lane = 0; lane < batch_width; lane++) {
+            copy_board(initial, boards[lane]);
+            load_board_lane(batch, lane, boards[lane]);
+        }
+        for (uint16_t turn = 74; turn < 194; turn++) {
+            lanes_t a_moves, b_moves;
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                a_moves[lane] = random_legal_move(mt, boards[lane].a);
+                b_moves[lane] = random_legal_move(mt, boards[lane].b);
+                advance_state(a_moves[lane], b_moves[lane], boards[lane].a, boards[lane].b, turn);
+            }
+            advance_state_batch(a_moves, b_moves, batch, turn);
+            for (uint8_t lane = 0; lane < batch_width; lane++) {
+                board_t lane_board;
+                std::memset(&lane_board, 0, sizeof(board_t));
+                store_board_lane(batch, lane, lane_board);
+                ASSERT_EQ(0, std::memcmp(&lane_board, &boards[lane], sizeof(board_t)))
+                    << "lane " << (int)lane << " turn " << turn;
+            }
+        }
+    }
+
+    TEST(AdvanceState, EveryPhaseMatchesTheWholeTurn) {
+        std::mt19937 mt(13);
+        for (const char* path : state_paths) {
+            std::string game_state_path(path);
+            for (uint8_t game = 0; game < 20; game++) {
+                board_t board;
+                uint16_t current_turn = bot::read_board(board, game_state_path);
+                for (uint16_t turn = current_turn; turn < current_turn + 120; turn++) {
+                    uint16_t a_move = random_legal_move(mt, board.a);
+                    uint16_t b_move = random_legal_move(mt, board.b);
+                    board_t whole_turn;
+                    copy_board(board, whole_turn);
+                    advance_state_in_phase<true, true>(a_move, b_move, whole_turn.a,
+                                                       whole_turn.b, turn);
+                    advance_state(a_move, b_move, board.a, board.b, turn);
+                    ASSERT_EQ(0, std::memcmp(&whole_turn, &board, sizeof(board_t)))
+                        << path << " game " << (int)game << " turn " << turn;
+                    if (board.a.health == 0 || board.b.health == 0) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    uint64_t sparse_bits(std::mt19937& mt) {
+        uint64_t bits = ((uint64_t)mt() << 32) | mt();
+        return bits & (((uint64_t)mt() << 32) | mt()) & (((uint64_t)mt() << 32) | mt());
+    }
+
+    // Missiles and buildings anywhere, so that every way two missile steps
+    // can play out comes up, not just those the game gets to.
+    void scatter_missiles_and_buildings(std::mt19937& mt, player_t& player,
+                                        bool has_tesla, bool curtain_active) {
+        std::memset(&player, 0, sizeof(player_t));
+        player.energy_buildings = sparse_bits(mt) & sparse_bits(mt);
+        for (uint8_t i = 0; i < 4; i++) {
+            player.attack_buildings[i] = sparse_bits(mt) & sparse_bits(mt);
+            player.defence_buildings[i] = sparse_bits(mt) & sparse_bits(mt);
+            player.player_missiles[i] = sparse_bits(mt);
+            player.enemy_half_missiles[i] = sparse_bits(mt);
+        }
+        for (uint8_t i = 0; has_tesla && i < 2; i++) {
+            player.tesla_towers[i] = make_tesla_tower(mt() % 2 ? -1 : mt() % 10, mt() % 11,
+                                                      mt() % 64);
+        }
+        player.health = mt() % 101;
+        player.turns_protected = curtain_active ? mt() % 7 : 0;
+        player.hash = hash_player(player);
+    }
+
+    template <bool HasTesla, bool CurtainActive>
+    void expect_fused_missile_steps_match_two_steps(std::mt19937& mt) {
+        for (uint32_t round = 0; round < 20000; round++) {
+            board_t board;
+            scatter_missiles_and_buildings(mt, board.a, HasTesla, CurtainActive);
+            scatter_missiles_and_buildings(mt, board.b, HasTesla, CurtainActive);
+            board_t two_steps;
+            copy_board(board, two_steps);
+            move_and_collide_missiles<true, true>(two_steps.a, two_steps.b);
+            move_and_collide_missiles<true, true>(two_steps.a, two_steps.b);
+            move_and_collide_missiles_twice<HasTesla, CurtainActive>(board.a, board.b);
+            move_and_collide_missiles_twice<HasTesla, CurtainActive>(board.b, board.a);
+            ASSERT_EQ(0, std::memcmp(&two_steps, &board, sizeof(board_t)))
+                << "round " << round;
+        }
+    }
+
+    TEST(MissileSteps, FusedStepsMatchTwoSingleStepsInEveryPhase) {
+        std::mt19937 mt(17);
+        expect_fused_missile_steps_match_two_steps<false, false>(mt);
+        expect_fused_missile_steps_match_two_steps<false, true>(mt);
+        expect_fused_missile_steps_match_two_steps<true, false>(mt);
+        expect_fused_missile_steps_match_two_steps<true, true>(mt);
+    }
+
+    void quieten(player_t& player, bool keep_missiles) {
+        player.attack_building_queue = 0;
+        player.energy_building_queue = 0;
+        for (uint8_t i = 0; i < 4 && !keep_missiles; i++) {
+            player.attack_buildings[i] = 0;
+            player.player_missiles[i] = 0;
+            player.enemy_half_missiles[i] = 0;
+        }
+        for (uint8_t i = 0; i < 3; i++) {
+            player.defence_building_queue[i] = 0;
+        }
+        player.tesla_towers[0] = 0;
+        player.tesla_towers[1] = 0;
+        player.turns_protected = 0;
+        player.hash = hash_player(player);
+    }
+
+    TEST(FastForward, MatchesPassingTurnByTurn) {
+        for (const char* path : state_paths) {
+            std::string game_state_path(path);
+            for (uint8_t quiet = 0; quiet < 3; quiet++) {
+                board_t initial;
+                uint16_t current_turn = bot::read_board(initial, game_state_path);
+                if (quiet > 0) {
+                    quieten(initial.a, quiet == 1);
+                    quieten(initial.b, quiet == 1);
+                }
+                for (uint16_t turn = current_turn; turn < current_turn + 4; turn++) {
+                    for (uint16_t turns = 1; turns <= 40; turns++) {
+                        board_t turn_by_turn;
+                        copy_board(initial, turn_by_turn);
+                        for (uint16_t i = 0; i < turns; i++) {
+                            advance_state(0, 0, turn_by_turn.a, turn_by_turn.b, turn + i);
+                        }
+                        board_t board;
+                        copy_board(initial, board);
+                        fast_forward(board.a, board.b, turn, turns);
+                        ASSERT_EQ(0, std::memcmp(&turn_by_turn, &board, sizeof(board_t)))
+                            << path << " quiet " << (int)quiet << " turn " << turn
+                            << " turns " << turns;
+                    }
+                }
+            }
+        }
+    }
+
+    TEST(SelectIthBit, FindsEveryBitFromTheTop) {
+        std::mt19937 mt(19);
+        for (uint32_t round = 0; round < 10000; round++) {
+            uint64_t n = ((uint64_t)mt() << 32) | mt();
+            n &= round % 2 ? sparse_bits(mt) | sparse_bits(mt) : ~(uint64_t)0;
+            uint64_t i = 0;
+            for (int8_t position = 63; position >= 0; position--) {
+                if (n >> position & 1) {
+                    i++;
+                    ASSERT_EQ(64 - position, select_ith_bit(n, i)) << std::hex << n << " " << i;
+                }
+            }
+        }
+    }
+
+    TEST(MoveList, MatchesDecodeMoveForEveryChoice) {
+        std::mt19937 mt(5);
+        move_list list;
+        for (const char* path : state_paths) {
+            std::string game_state_path(path);
+            board_t board;
+            uint16_t current_turn = bot::read_board(board, game_state_path);
+            for (uint16_t turn = current_turn; turn < current_turn + 60; turn++) {
+                for (player_t* player : {&board.a, &board.b}) {
+                    uint8_t available = count_zero_bits(find_occupied(*player));
+                    uint16_t counts[] = {calculate_number_of_choices(*player), 1,
+                                         (uint16_t)(available + 1),
+                                         (uint16_t)(available * 3 + 1),
+                                         (uint16_t)(available * 4 + 1)};
+                    for (uint16_t number_of_choices : counts) {
+                        for (bool mirrored : {false, true}) {
+                            generate_moves(*player, number_of_choices, list, mirrored);
+                            ASSERT_EQ(number_of_choices, list.number_of_choices);
+                            for (uint16_t choice = 0; choice < number_of_choices; choice++) {
+                                uint16_t move = decode_move(choice, *player, number_of_choices,
+                                                            mirrored);
+                                ASSERT_EQ(move, list.moves[choice]) << path << " turn " << turn
+                                    << " choice " << choice << " mirrored " << mirrored;
+                                ASSERT_EQ(move, cached_move(choice, *player, number_of_choices,
+                                                            mirrored));
+                            }
+                        }
+                    }
+                }
+                uint16_t a_move = random_legal_move(mt, board.a);
+                uint16_t b_move = random_legal_move(mt, board.b);
+                advance_state(a_move, b_move, board.a, board.b, turn);
+            }
+        }
+    }
+
+    TEST(Hashing, IncrementalHashMatchesFullRehashEveryTurn) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, state_path);
+        ASSERT_EQ(hash_player(board.a), board.a.hash);
+        ASSERT_EQ(hash_player(board.b), board.b.hash);
+        ASSERT_NE(board.a.hash, board.b.hash);
+        std::mt19937 mt(11);
+        for (uint16_t turn = current_turn; turn < current_turn + 120; turn++) {
+            uint16_t a_move = random_legal_move(mt, board.a);
+            uint16_t b_move = random_legal_move(mt, board.b);
+            uint64_t before = board_hash(board, turn);
+            advance_state(a_move, b_move, board.a, board.b, turn);
+            ASSERT_EQ(hash_player(board.a), board.a.hash) << "turn " << turn;
+            ASSERT_EQ(hash_player(board.b), board.b.hash) << "turn " << turn;
+            ASSERT_NE(before, board_hash(board, turn + 1));
+        }
+    }
+
+    TEST(Hashing, TransposedMoveOrdersMeetOnceTheBuildingsAreFinished) {
+        board_t initial, first, second;
+        std::string quiet_state_path("not_move_state.json");
+        uint16_t current_turn = bot::read_board(initial, quiet_state_path);
+        uint16_t number_of_choices = calculate_number_of_choices(initial.a);
+        uint16_t left = decode_move(1, initial.a, number_of_choices);
+        uint16_t right = decode_move(2, initial.a, number_of_choices);
+        ASSERT_EQ(1, left & 7);
+        ASSERT_EQ(1, right & 7);
+        copy_board(initial, first);
+        copy_board(initial, second);
+        advance_state(left, 0, first.a, first.b, current_turn);
+        advance_state(right, 0, first.a, first.b, current_turn + 1);
+        advance_state(right, 0, second.a, second.b, current_turn);
+        advance_state(left, 0, second.a, second.b, current_turn + 1);
+        ASSERT_NE(board_hash(first, current_turn + 2), board_hash(second, current_turn + 2));
+        for (uint16_t turn = current_turn + 2; turn < current_turn + 6; turn++) {
+            advance_state(0, 0, first.a, first.b, turn);
+            advance_state(0, 0, second.a, second.b, turn);
+        }
+        ASSERT_EQ(board_hash(first, current_turn + 6), board_hash(second, current_turn + 6));
+    }
+
+    TEST(Hashing, SpreadsPositionsThatDifferInOneRowOverBuckets) {
+        board_t board;
+        std::string open_path("not_move_state.json");
+        uint16_t current_turn = bot::read_board(board, open_path);
+        uint64_t unoccupied = ~find_occupied(board.a);
+        std::set<uint32_t> buckets;
+        uint8_t siblings = 0;
+        for (uint8_t position = 16; position < 32; position++) {
+            if (!((unoccupied >> position) & 1)) {
+                continue;
+            }
+            board_t sibling;
+            copy_board(board, sibling);
+            set_field(sibling.a.hash, energy_buildings_field, sibling.a.energy_buildings,
+                      sibling.a.energy_buildings | ((uint64_t)1 << position));
+            buckets.insert(board_hash(sibling, current_turn) & (table_buckets - 1));
+            siblings++;
+        }
+        ASSERT_GE(siblings, 8);
+        ASSERT_GE(buckets.size() + 1, siblings);
+    }
+
+    TEST(Mirror, MirroredGamesStayMirrorImages) {
+        std::mt19937 mt(17);
+        for (const char* path : state_paths) {
+            std::string game_state_path(path);
+            board_t board, mirrored, expected;
+            uint16_t current_turn = bot::read_board(board, game_state_path);
+            mirror_board(board, mirrored);
+            for (uint16_t turn = current_turn; turn < current_turn + 60; turn++) {
+                ASSERT_NE(is_mirrored(board), is_mirrored(mirrored)) << path << " turn " << turn;
+                ASSERT_EQ(canonical_board_hash(board, turn), canonical_board_hash(mirrored, turn));
+                bool mirrored_a = is_mirrored(board);
+                uint16_t number_of_choices = calculate_number_of_choices(board.a);
+                for (uint16_t choice = 0; choice < number_of_choices; choice++) {
+                    ASSERT_EQ(decode_move(choice, board.a, number_of_choices, mirrored_a),
+                              mirror_move(decode_move(choice, mirrored.a, number_of_choices,
+                                                      !mirrored_a)));
+                }
+                uint16_t a_move = random_legal_move(mt, board.a);
+                uint16_t b_move = random_legal_move(mt, board.b);
+                advance_state(a_move, b_move, board.a, board.b, turn);
+                advance_state(mirror_move(a_move), mirror_move(b_move),
+                              mirrored.a, mirrored.b, turn);
+                mirror_board(board, expected);
+                ASSERT_EQ(0, std::memcmp(&expected, &mirrored, sizeof(board_t)))
+                    << path << " turn " << turn;
+            }
+            uint8_t tesla_position = 63 - __builtin_clzll(~find_occupied(board.a));
+            board.a.tesla_towers[0] = make_tesla_tower(9, 0, tesla_position);
+            mirror_board(board, mirrored);
+            ASSERT_FALSE(is_mirrored(board));
+            ASSERT_FALSE(is_mirrored(mirrored));
+        }
+    }
+
+    TEST(TranspositionTable, FindsStoredChildrenAndCountsCollisions) {
+        std::unique_ptr<transposition_table<4>> table(new transposition_table<4>());
+        clear_table(*table);
+        uint32_t children = 0;
+        ASSERT_FALSE(probe(*table, 42, 10, children));
+        store(*table, 42, 10, 1234, 80);
+        ASSERT_TRUE(probe(*table, 42, 10, children));
+        ASSERT_EQ(1234u, children);
+        ASSERT_FALSE(probe(*table, 42, 11, children));
+        for (uint64_t key = 46; key < 46 + 4 * 4; key += 4) {
+            store(*table, key, 10, key, 100 + key);
+        }
+        ASSERT_TRUE(probe(*table, 42, 10, children));
+        ASSERT_FALSE(probe(*table, 46 + 4 * 2, 10, children));
+        transposition_stats stats = table_stats(*table);
+        ASSERT_EQ(2u, stats.hits);
+        ASSERT_EQ(2u, stats.misses);
+        ASSERT_EQ(1u, stats.collisions);
+    }
+
+    void load_with_both_readers(const std::string& text, board_t& streamed, board_t& oracle) {
+        std::memset(&streamed, 0, sizeof(board_t));
+        std::memset(&oracle, 0, sizeof(board_t));
+        uint16_t streamed_turn = load_state(streamed.a, streamed.b,
+                                            text.data(), text.data() + text.size());
+        uint16_t oracle_turn = read_from_state(oracle.a, oracle.b, json::parse(text));
+        ASSERT_EQ(oracle_turn, streamed_turn);
+    }
+
+    TEST(StreamingReader, MatchesTheJsonDomReaderOnEveryStateFile) {
+        for (const char* path : state_paths) {
+            std::string text;
+            ASSERT_TRUE(read_file(path, text)) << path;
+            board_t streamed, oracle;
+            load_with_both_readers(text, streamed, oracle);
+            ASSERT_EQ(0, std::memcmp(&streamed, &oracle, sizeof(board_t))) << path;
+            // Sorted keys put cellOwner after the buildings and the
+            // indentation adds whitespace everywhere.
+            json state = json::parse(text);
+            load_with_both_readers(state.dump(2), streamed, oracle);
+            ASSERT_EQ(0, std::memcmp(&streamed, &oracle, sizeof(board_t))) << path;
+            std::string map_first = "{\"gameMap\":" + state.at("gameMap").dump()
+                + ",\"players\":" + state.at("players").dump()
+                + ",\"gameDetails\":" + state.at("gameDetails").dump() + "}";
+            load_with_both_readers(map_first, streamed, oracle);
+            ASSERT_EQ(0, std::memcmp(&streamed, &oracle, sizeof(board_t))) << path;
+        }
+    }
+
+    TEST(StreamingReader, RejectsTruncatedInput) {
+        std::string text;
+        ASSERT_TRUE(read_file(state_path, text));
+        board_t board;
+        std::memset(&board, 0, sizeof(board_t));
+        ASSERT_EQ((uint16_t) -1, load_state(board.a, board.b,
+                                            text.data(), text.data() + text.size() / 2));
+        // Cut off right after a backslash inside a string, in a buffer that
+        // ends there, so reading on would run past it.
+        std::string escaped = text.substr(0, text.find('"') + 2) + "\\";
+        std::vector<char> cut(escaped.begin(), escaped.end());
+        ASSERT_EQ((uint16_t) -1, load_state(board.a, board.b, cut.data(),
+                                            cut.data() + cut.size()));
+    }
+
+    TEST(Selection, VectorKernelPicksAChildWithinToleranceOfTheScalarChoice) {
+        std::mt19937 mt(17);
+        alignas(64) uint32_t simulations[264];
+        alignas(64) uint32_t wins[264];
+        for (uint32_t round = 0; round < 2000; round++) {
+            uint16_t number_of_choices = 1 + mt() % 257;
+            uint32_t total_simulations = 0;
+            for (uint16_t i = 0; i < 264; i++) {
+                simulations[i] = 1 + mt() % (round < 1000 ? 50 : 100000);
+                wins[i] = mt() % (simulations[i] + 1);
+                total_simulations += simulations[i];
+            }
+            if (round % 4 == 0) {
+                simulations[mt() % number_of_choices] = 0;
+            }
+            uint16_t scalar = select_uct_scalar(simulations, wins, number_of_choices,
+                                                total_simulations);
+            uint16_t vector = select_uct(simulations, wins, number_of_choices, total_simulations);
+            ASSERT_LT(vector, number_of_choices);
+            if (simulations[scalar] == 0) {
+                ASSERT_EQ(scalar, vector);
+                continue;
+            }
+            float best = uct(wins[scalar], simulations[scalar], total_simulations);
+            float picked = uct(wins[vector], simulations[vector], total_simulations);
+            ASSERT_GE(picked, best * (1 - 2e-5f)) << "round " << round;
+        }
+    }
+
+    const uint32_t test_tree_bytes = 20000000;
+
+    std::vector<uint32_t> child_visits(thread_state<test_tree_bytes>& memory,
+                                       player_node<test_tree_bytes> node) {
+        std::vector<uint32_t> visits(node.number_of_choices, 0);
+        for_each_child(memory, node, [&](uint16_t i, player_node<test_tree_bytes> child) {
+            visits[i] = child.simulations;
+        });
+        return visits;
+    }
+
+    // A fresh tree at the position of a state file and a seeded worker to
+    // grow it, which is where most of the search tests start.
+    struct seeded_search {
+        board_t board;
+        uint16_t current_turn;
+        search_tree<test_tree_bytes> tree;
+        xoshiro256ss rng;
+        std::atomic<bool> stop_search;
+
+        explicit seeded_search(std::string path) : stop_search(false) {
+            current_turn = bot::read_board(board, path);
+            reset_tree(tree, board, current_turn);
+            seed_worker(rng, 5, 0);
+        }
+
+        uint64_t grow(uint64_t iterations) {
+            return grow_tree(rng, tree, stop_search, iterations);
+        }
+    };
+
+    TEST(Evaluator, ScoresBothSidesConsistentlyAndCutsRolloutsOff) {
+        for (const char* path : {"old_state.json", "not_move_state.json"}) {
+            seeded_search search(path);
+            board_t& board = search.board;
+            float a_wins = feature_win_probability(board.a, board.b);
+            ASSERT_NEAR(1, a_wins + feature_win_probability(board.b, board.a), 1e-5) << path;
+            board.a.health += 50;
+            ASSERT_GT(feature_win_probability(board.a, board.b), a_wins) << path;
+            board.a.health -= 50;
+
+            search.tree.policy.horizon = 10;
+            ASSERT_EQ(2000u, search.grow(2000));
+            ASSERT_EQ(2000u, root_node(search.tree).simulations) << path;
+        }
+    }
+
+    TEST(Solver, ProvesAGameDecidedWithinATurnAndStopsSearchingIt) {
+        seeded_search search(state_path);
+        search_tree<test_tree_bytes>& tree = search.tree;
+        board_t& board = search.board;
+        search.grow(20000);
+        player_node<test_tree_bytes> a_root = root_node(tree);
+        ASSERT_EQ(proven_loss, a_root.proof);
+
+        std::vector<uint8_t> proofs(a_root.number_of_choices, unproven);
+        for_each_child(*tree.memory, a_root, [&](uint16_t i, player_node<test_tree_bytes> child) {
+            proofs[i] = child.proof;
+        });
+        uint16_t a_index = most_visited(child_visits(*tree.memory, a_root).data(),
+                                        proofs.data(), a_root.number_of_choices);
+        ASSERT_EQ(proven_win, proofs[a_index]);
+        bool mirrored = is_mirrored(board);
+        uint16_t a_move = decode_move(a_index, board.a, a_root.number_of_choices, mirrored);
+        uint16_t b_choices = calculate_number_of_choices(board.b);
+        for (uint16_t b_index = 0; b_index < b_choices; b_index++) {
+            board_t played;
+            copy_board(board, played);
+            uint16_t b_move = decode_move(b_index, played.b, b_choices, mirrored);
+            advance_state(a_move, b_move, played.a, played.b, search.current_turn);
+            ASSERT_EQ(0, played.b.health) << "reply " << b_index;
+            ASSERT_GT(played.a.health, 0) << "reply " << b_index;
+        }
+
+        uint64_t used = tree.memory->buffer[0].used.load();
+        ASSERT_EQ(1000u, search.grow(1000));
+        ASSERT_EQ(used, tree.memory->buffer[0].used.load());
+    }
+
+    TEST(Solver, SelectionPassesOverChildrenProvenLost) {
+        alignas(64) uint32_t simulations[16] = {};
+        alignas(64) uint32_t wins[16] = {};
+        alignas(64) uint8_t proofs[16] = {};
+        for (uint16_t i = 0; i < 16; i++) {
+            simulations[i] = 100;
+            wins[i] = i;
+        }
+        proofs[15] = proven_loss;
+        proofs[14] = proven_loss;
+        uct_selection selection;
+        start_selection(selection, 1600);
+        score_children(selection, simulations, wins, 0, 16, proofs);
+        uint16_t child;
+        ASSERT_FALSE(selected_child(selection, child));
+        ASSERT_EQ(13, child);
+    }
+
+    TEST(SearchTree, PromotesTheSubtreeOfThePlayedMoves) {
+        seeded_search search(open_state_path);
+        search_tree<test_tree_bytes>& tree = search.tree;
+        board_t& board = search.board;
+        uint16_t current_turn = search.current_turn;
+        ASSERT_EQ(20000u, search.grow(20000));
+
+        player_node<test_tree_bytes> a_root = root_node(tree);
+        uint16_t a_index = most_visited(child_visits(*tree.memory, a_root).data(),
+                                        a_root.number_of_choices);
+        child_block<test_tree_bytes> first = a_root.get_children(*tree.memory);
+        player_node<test_tree_bytes> replies = replies_of(a_root, first);
+        std::vector<uint32_t> pair_visits(replies.number_of_choices, 0);
+        for (uint16_t b_index = 0; b_index < replies.number_of_choices; b_index++) {
+            joint_slot found;
+            if (find_joint_child(*tree.memory, first, a_index, b_index, found)) {
+                pair_visits[b_index] = joint_node(*tree.memory, found).simulations;
+            }
+        }
+        uint16_t b_index = most_visited(pair_visits.data(), replies.number_of_choices);
+        joint_slot found;
+        ASSERT_TRUE(find_joint_child(*tree.memory, first, a_index, b_index, found));
+        player_node<test_tree_bytes> played = joint_node(*tree.memory, found);
+        uint32_t played_simulations = played.simulations;
+        uint16_t played_choices = played.number_of_choices;
+        ASSERT_GT(played_simulations, 1u);
+        bool mirrored = is_mirrored(board);
+        uint16_t a_move = decode_move(a_index, board.a, a_root.number_of_choices, mirrored);
+        uint16_t b_move = decode_move(b_index, board.b, replies.number_of_choices, mirrored);
+        advance_state(a_move, b_move, board.a, board.b, current_turn);
+
+        ASSERT_FALSE(advance_tree(tree, a_index, board, current_turn + 2));
+        ASSERT_TRUE(advance_tree(tree, a_index, board, current_turn + 1));
+        player_node<test_tree_bytes> root = root_node(tree);
+        ASSERT_EQ(played_simulations, root.simulations);
+        ASSERT_EQ(played_choices, root.number_of_choices);
+        ASSERT_EQ(1, tree.memory->buffer_index);
+        ASSERT_EQ(current_turn + 1, tree.turn);
+        ASSERT_EQ(100u, search.grow(100));
+        ASSERT_EQ(played_simulations + 100, root_node(tree).simulations);
+    }
+
+    TEST(SearchTree, KeepsTheArraysOfAChildBlockAligned) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, state_path);
+        search_tree<test_tree_bytes> tree;
+        reset_tree(tree, board, current_turn);
+        for (uint16_t capacity : {16, 32, 128}) {
+            uint32_t index = allocate_child_block(*tree.memory, capacity);
+            child_block<test_tree_bytes> block(get_buffer_by_index(*tree.memory, index),
+                                               0, 0, capacity);
+            ASSERT_EQ(0u, (uintptr_t)block.simulations % cache_line_bytes);
+            ASSERT_EQ(0u, (uintptr_t)block.wins % cache_line_bytes);
+            ASSERT_EQ(0u, (uintptr_t)block.children % cache_line_bytes);
+            ASSERT_EQ(0u, (uintptr_t)block.number_of_choices % cache_line_bytes);
+            ASSERT_EQ(0u, (uintptr_t)block.proofs % 32);
+            ASSERT_EQ((uint32_t)-1, block.children[capacity - 1]);
+            ASSERT_EQ((uint32_t)-1, *block.next);
+        }
+    }
+
+    TEST(SearchTree, FindsEveryPairInTheJointTableOnce) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, state_path);
+        search_tree<test_tree_bytes> tree;
+        reset_tree(tree, board, current_turn);
+        thread_state<test_tree_bytes>& memory = *tree.memory;
+        child_block<test_tree_bytes> first = root_node(tree).get_children(memory);
+        for (uint8_t pass = 0; pass < 2; pass++) {
+            for (uint16_t a_index = 0; a_index < 93; a_index++) {
+                for (uint16_t b_index = 0; b_index < 47; b_index++) {
+                    bool inserted;
+                    player_node<test_tree_bytes> node = get_joint_child(memory, first, a_index,
+                                                                        b_index, inserted);
+                    ASSERT_EQ(pass == 0, inserted);
+                    ASSERT_EQ(pass, node.simulations);
+                    node.simulations++;
+                }
+            }
+        }
+        joint_slot found;
+        ASSERT_FALSE(find_joint_child(memory, first, 93, 0, found));
+        ASSERT_TRUE(find_joint_child(memory, first, 92, 46, found));
+        ASSERT_GT(found.block, 0);
+        ASSERT_EQ(2u, joint_node(memory, found).simulations);
+        joint_block<test_tree_bytes> joint = get_joint_block(memory, found.index, found.block);
+        ASSERT_EQ(0u, (uintptr_t)joint.keys % cache_line_bytes);
+        ASSERT_EQ(0u, (uintptr_t)joint.nodes.simulations % cache_line_bytes);
+    }
+
+    TEST(SearchTree, AddsAChildBlockOnlyOnceEveryChildBeforeItWasVisited) {
+        seeded_search search(state_path);
+        thread_state<test_tree_bytes>& memory = *search.tree.memory;
+        player_node<test_tree_bytes> root = root_node(search.tree);
+        ASSERT_EQ(4 * 23 + 1, root.number_of_choices);
+        search.grow(child_block_base);
+        ASSERT_FALSE(has_child(memory, root, child_block_base));
+        search.grow(1);
+        ASSERT_TRUE(has_child(memory, root, child_block_base));
+        ASSERT_FALSE(has_child(memory, root, 2 * child_block_base));
+        ASSERT_EQ(1u, get_child(memory, root, child_block_base).simulations);
+        search.grow(root.number_of_choices - child_block_base - 1);
+        std::vector<uint32_t> visits = child_visits(memory, root);
+        ASSERT_EQ(root.number_of_choices, std::count(visits.begin(), visits.end(), 1u));
+    }
+
+    TEST(SearchTree, StopsGrowingWhenTheMemoryBudgetRunsOut) {
+        seeded_search search(open_state_path);
+        arena& arena = search.tree.memory->buffer[0];
+        ASSERT_EQ(0u, arena.committed.load());
+        memory_budget_t& budget = memory_budget();
+        uint64_t limit = budget.limit.load();
+        budget.limit.store(budget.committed.load() + 2 * arena_chunk_bytes);
+        uint64_t iterations = search.grow(1000000);
+        budget.limit.store(limit);
+        ASSERT_LT(iterations, 1000000u);
+        ASSERT_EQ(2 * arena_chunk_bytes, arena.committed.load());
+        ASSERT_LE(arena.used.load(), arena.committed.load());
+    }
+
+    TEST(SearchTree, KeepsRollingOutWithoutExpandingOnceTheArenaIsFull) {
+        seeded_search search(open_state_path);
+        search_tree<test_tree_bytes>& tree = search.tree;
+        arena& arena = tree.memory->buffer[0];
+        arena.used.store(arena.reserved);
+        player_node<test_tree_bytes> root = root_node(tree);
+        for (uint8_t i = 0; i < 100; i++) {
+            uint8_t a_reward;
+            uint8_t b_reward;
+            board_t board_copy;
+            copy_board(tree.board, board_copy);
+            sm_mcts<false>(search.rng, a_reward, b_reward, root, *tree.memory, board_copy,
+                           tree.turn, tree.policy);
+        }
+        ASSERT_EQ(100u, root.simulations);
+        ASSERT_EQ((uint32_t)-1, root.children);
+    }
+
+    TEST(SearchTree, SharedTreeCountsEveryWorkersVisitsExactlyOnce) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, open_state_path);
+        search_options options;
+        options.iterations.push_back(2000);
+        options.threads = 4;
+        options.tree_parallel = true;
+        std::unique_ptr<search_workers<test_tree_bytes>>
+            workers(new search_workers<test_tree_bytes>(options));
+        ASSERT_EQ(1, tree_count(*workers));
+        start_workers(*workers, 13);
+        search_tree<test_tree_bytes>& tree = workers->trees[0];
+        reset_tree(tree, board, current_turn);
+        search_round(*workers, search_clock_t::now());
+        stop_workers(*workers);
+        player_node<test_tree_bytes> root = root_node(tree);
+        ASSERT_EQ(4 * 2000u, root.simulations);
+        uint32_t child_simulations = 0;
+        for_each_child(*tree.memory, root, [&](uint16_t, player_node<test_tree_bytes> child) {
+            child_simulations += child.simulations;
+            ASSERT_LE(child.wins, child.simulations);
+        });
+        ASSERT_EQ(root.simulations, child_simulations);
+        player_node<test_tree_bytes> replies = replies_of(root, root.get_children(*tree.memory));
+        uint32_t reply_simulations = 0;
+        for_each_child(*tree.memory, replies, [&](uint16_t, player_node<test_tree_bytes> reply) {
+            reply_simulations += reply.simulations;
+        });
+        ASSERT_EQ(root.simulations, reply_simulations);
+    }
+
+    TEST(SearchWorkers, StayAliveAcrossRounds) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, state_path);
+        search_options options;
+        options.iterations.push_back(50);
+        options.threads = 3;
+        std::unique_ptr<search_workers<test_tree_bytes>>
+            workers(new search_workers<test_tree_bytes>(options));
+        ASSERT_EQ(3, workers->workers);
+        start_workers(*workers, 9);
+        for (search_tree<test_tree_bytes>& tree : workers->trees) {
+            reset_tree(tree, board, current_turn);
+        }
+        for (uint8_t round = 0; round < 2; round++) {
+            search_round(*workers, search_clock_t::now());
+            for (uint8_t i = 0; i < workers->workers; i++) {
+                ASSERT_EQ(50u, workers->iterations[i]);
+                ASSERT_EQ(50u * (round + 1), root_node(workers->trees[i]).simulations);
+            }
+        }
+        stop_workers(*workers);
+    }
+
+    TEST(SearchWorkers, StopEarlyOnceTheLeaderCannotBeCaught) {
+        board_t board;
+        uint16_t current_turn = bot::read_board(board, state_path);
+        search_options options;
+        options.threads = 1;
+        std::unique_ptr<search_workers<test_tree_bytes>>
+            workers(new search_workers<test_tree_bytes>(options));
+        reset_tree(workers->trees[0], board, current_turn);
+        player_node<test_tree_bytes> root = root_node(workers->trees[0]);
+        child_block<test_tree_bytes> children = root.get_children(*workers->trees[0].memory);
+        children.simulations[0] = 1000000;
+        ASSERT_TRUE(leader_is_settled(*workers, std::chrono::milliseconds(1000),
+                                      std::chrono::milliseconds(100)));
+        children.simulations[1] = 999000;
+        ASSERT_FALSE(leader_is_settled(*workers, std::chrono::milliseconds(1000),
+                                       std::chrono::milliseconds(100)));
+        children.simulations[0] = 100000000;
+        children.simulations[2] = 998000;
+        children.proofs[0] = proven_loss;
+        ASSERT_FALSE(leader_is_settled(*workers, std::chrono::milliseconds(1000),
+                                       std::chrono::milliseconds(100)));
+        children.proofs[2] = proven_win;
+        ASSERT_TRUE(leader_is_settled(*workers, std::chrono::milliseconds(1000),
+                                      std::chrono::milliseconds(100)));
+    }
+
+    TEST(SearchOptions, KeepThreadsAndTasksWithinTheSharedCap) {
+        const char* wrapping[] = {"bot", "--threads", "256"};
+        search_options options = parse_search_options(3, const_cast<char**>(wrapping));
+        ASSERT_EQ(0, options.threads);
+        ASSERT_LE(search_thread_count(options), max_search_threads);
+        const char* eight[] = {"bot", "--threads", "8"};
+        options = parse_search_options(3, const_cast<char**>(eight));
+        ASSERT_EQ(8, search_thread_count(options));
+        options.iterations.assign(100, 10);
+        ASSERT_EQ(max_search_threads, search_tasks(options, 8));
+    }
+
+    TEST(SearchOptions, IgnoresHorizonsOutsideAFullRollout) {
+        const char* wrapping[] = {"bot", "--horizon", "65537"};
+        search_options options = parse_search_options(3, const_cast<char**>(wrapping));
+        ASSERT_EQ(full_rollout_turns, options.horizon);
+        const char* forty[] = {"bot", "--horizon", "40"};
+        options = parse_search_options(3, const_cast<char**>(forty));
+        ASSERT_EQ(40, options.horizon);
+    }
+
+    TEST(WorkerPool, RunsEveryTaskWithMoreTasksThanThreads) {
+        ASSERT_GE(available_cpus(), 1u);
+        worker_pool pool(3);
+        start_pool(pool);
+        std::atomic<uint32_t> done(0);
+        for (uint8_t round = 0; round < 2; round++) {
+            for (uint32_t i = 0; i < 100; i++) {
+                submit(pool, [&done, i] {
+                    if (i % 10 == 0) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                    done++;
+                });
+            }
+            wait_for_tasks(pool);
+            ASSERT_EQ(100u * (round + 1), done.load());
+        }
+        stop_pool(pool);
+    }
+
+    TEST(BoardPool, BlocksLoadTheBoardsScatteredIntoThem) {
+        board_t initial;
+        bot::read_board(initial, state_path);
+        board_pool<2 * pool_block_stride> pool;
+        clear_pool(pool);
+        uint16_t first = rent_block(pool);
+        uint16_t second = rent_block(pool);
+        ASSERT_NE(first, second);
+        ASSERT_EQ((uint16_t) -1, rent_block(pool));
+        scatter_board(initial, pool, block_slot(second, 1));
+        board_batch_t batch;
+        load_block(pool, second, batch);
+        board_t lane_board;
+        std::memset(&lane_board, 0, sizeof(board_t));
+        store_board_lane(batch, 1, lane_board);
+        ASSERT_EQ(0, std::memcmp(&lane_board, &initial, sizeof(board_t)));
+        store_block(batch, pool, first);
+        gather_board(pool, block_slot(first, 1), lane_board);
+        ASSERT_EQ(0, std::memcmp(&lane_board, &initial, sizeof(board_t)));
+        return_block(pool, first);
+        ASSERT_EQ(first, rent_block(pool));
+    }
+
+    TEST(SeededSearch, ReplaysTheSameStatisticsForTheSameWorker) {
+        board_t initial;
+        uint16_t current_turn = bot::read_board(initial, state_path);
+        search_pool_t pool;
+        clear_pool(pool);
+        std::atomic<bool> stop_search(false);
+        search_shard_t first, replay, other_worker;
+        std::memset(&first, 0, sizeof(search_shard_t));
+        std::memset(&replay, 0, sizeof(search_shard_t));
+        std::memset(&other_worker, 0, sizeof(search_shard_t));
+        mc_search(initial, pool, first, stop_search, current_turn, 42, 1, 50);
+        mc_search(initial, pool, replay, stop_search, current_turn, 42, 1, 50);
+        mc_search(initial, pool, other_worker, stop_search, current_turn, 42, 2, 50);
+        ASSERT_EQ(50u, first.iterations);
+        ASSERT_EQ(0, std::memcmp(&first, &replay, sizeof(search_shard_t)));
+        ASSERT_NE(0, std::memcmp(first.move_scores, other_worker.move_scores,
+                                 sizeof(first.move_scores)));
     }
 
-    
 }
 
 int main(int argc, char** argv) {
@@ -154,6 +154,8 @@ namespace tick_test {
             board.b.health = 100;
             board.a.energy = 20;
             board.b.energy = 20;
+            board.a.hash = bot::hash_player(board.a);
+            board.b.hash = bot::hash_player(board.b);
             
             for (auto it = round_dirs.begin(); it != round_dirs.end(); it++) {
                 read_round_and_tick(*it, board.a, board.b);
@@ -0,0 +1,130 @@
+#ifndef TRANSPOSITION_H
+#define TRANSPOSITION_H
+
+#include <stdint.h>
+#include <atomic>
+
+namespace bot {
+
+    struct transposition_stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t collisions;
+    };
+
+    // Fixed-size, lock-free table in the style of Hyatt's lockless hashing:
+    // a slot holds key ^ data next to data, so a slot torn by a concurrent
+    // store fails the key check and reads as a miss. data packs the arena
+    // index of the children (high 32 bits), the number of choices (16) and
+    // the turn the position was reached on (low 16). A real entry always
+    // has at least one choice, so data == 0 marks an empty slot.
+    template <uint32_t Buckets>
+    struct transposition_table {
+        static_assert((Buckets & (Buckets - 1)) == 0, "bucket count must be a power of two");
+        static const uint8_t bucket_size = 4;
+
+        struct slot {
+            std::atomic<uint64_t> check;
+            std::atomic<uint64_t> data;
+        };
+
+        slot slots[Buckets][bucket_size];
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> collisions;
+    };
+
+    template <uint32_t Buckets>
+    void clear_table(transposition_table<Buckets>& table) {
+        for (uint32_t i = 0; i < Buckets; i++) {
+            for (uint8_t j = 0; j < table.bucket_size; j++) {
+                table.slots[i][j].check.store(0, std::memory_order_relaxed);
+                table.slots[i][j].data.store(0, std::memory_order_relaxed);
+            }
+        }
+        table.hits.store(0, std::memory_order_relaxed);
+        table.misses.store(0, std::memory_order_relaxed);
+        table.collisions.store(0, std::memory_order_relaxed);
+    }
+
+    inline uint64_t pack_entry(uint32_t children, uint16_t number_of_choices, uint16_t turn) {
+        return ((uint64_t)children << 32) | ((uint64_t)number_of_choices << 16) | turn;
+    }
+
+    inline uint32_t entry_children(uint64_t data) {
+        return data >> 32;
+    }
+
+    inline uint16_t entry_choices(uint64_t data) {
+        return (data >> 16) & 65535;
+    }
+
+    inline uint16_t entry_turn(uint64_t data) {
+        return data & 65535;
+    }
+
+    // A key match with a different number of choices can only be two
+    // positions sharing a hash, which is counted as a collision and not
+    // followed.
+    template <uint32_t Buckets>
+    bool probe(transposition_table<Buckets>& table,
+               uint64_t key,
+               uint16_t number_of_choices,
+               uint32_t& children) {
+        typename transposition_table<Buckets>::slot* bucket = table.slots[key & (Buckets - 1)];
+        for (uint8_t i = 0; i < table.bucket_size; i++) {
+            uint64_t data = bucket[i].data.load(std::memory_order_relaxed);
+            if (data && (bucket[i].check.load(std::memory_order_relaxed) ^ data) == key) {
+                if (entry_choices(data) != number_of_choices) {
+                    table.collisions.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                children = entry_children(data);
+                table.hits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        table.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Replaces the deepest entry of the bucket when it is full: positions
+    // near the root head the largest subtrees and are the ones worth
+    // finding again.
+    template <uint32_t Buckets>
+    void store(transposition_table<Buckets>& table,
+               uint64_t key,
+               uint16_t number_of_choices,
+               uint32_t children,
+               uint16_t turn) {
+        typename transposition_table<Buckets>::slot* bucket = table.slots[key & (Buckets - 1)];
+        uint8_t victim = 0;
+        uint16_t deepest = 0;
+        for (uint8_t i = 0; i < table.bucket_size; i++) {
+            uint64_t data = bucket[i].data.load(std::memory_order_relaxed);
+            if (data == 0 || (bucket[i].check.load(std::memory_order_relaxed) ^ data) == key) {
+                victim = i;
+                break;
+            }
+            if (entry_turn(data) >= deepest) {
+                deepest = entry_turn(data);
+                victim = i;
+            }
+        }
+        uint64_t data = pack_entry(children, number_of_choices, turn);
+        bucket[victim].data.store(data, std::memory_order_relaxed);
+        bucket[victim].check.store(key ^ data, std::memory_order_relaxed);
+    }
+
+    template <uint32_t Buckets>
+    transposition_stats table_stats(const transposition_table<Buckets>& table) {
+        transposition_stats stats;
+        stats.hits = table.hits.load(std::memory_order_relaxed);
+        stats.misses = table.misses.load(std::memory_order_relaxed);
+        stats.collisions = table.collisions.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+}
+
+#endif
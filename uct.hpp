@@ -0,0 +1,197 @@
+#ifndef UCT_H
+#define UCT_H
+
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+
+namespace bot {
+
+    const float exploration = std::sqrt(2);
+
+    // What a child is proven to be worth to the player choosing it, as in
+    // MCTS-Solver. Selection never picks a child proven lost.
+    enum proof_t : uint8_t {
+        unproven = 0,
+        proven_win = 1,
+        proven_loss = 2,
+        proven_draw = 3
+    };
+
+    inline float uct(uint32_t node_wins, uint32_t node_simulations, uint32_t total_simulations) {
+        return ((float) node_wins / (float) node_simulations) +
+            exploration * std::sqrt(std::log((float) total_simulations) / node_simulations);
+    }
+
+    // Picks the first unvisited child, or else the child with the highest
+    // UCT score, the first one on ties.
+    inline uint16_t select_uct_scalar(const uint32_t* simulations,
+                                      const uint32_t* wins,
+                                      uint16_t number_of_choices,
+                                      uint32_t total_simulations) {
+        float best = 0.;
+        uint16_t best_index = 0;
+        for (uint16_t i = 0; i < number_of_choices; i++) {
+            if (simulations[i] == 0) {
+                return i;
+            }
+            float node_value = uct(wins[i], simulations[i], total_simulations);
+            if (node_value > best) {
+                best = node_value;
+                best_index = i;
+            }
+        }
+        return best_index;
+    }
+
+    // The parent's visit count is small for most nodes of a tree, so its
+    // logarithm is looked up rather than computed.
+    const uint32_t log_table_size = 1 << 12;
+
+    struct log_table_t {
+        float values[log_table_size];
+
+        log_table_t() {
+            values[0] = 0;
+            for (uint32_t i = 1; i < log_table_size; i++) {
+                values[i] = std::log((float) i);
+            }
+        }
+    };
+
+    inline float parent_log(uint32_t total_simulations) {
+        static const log_table_t table;
+        if (total_simulations < log_table_size) {
+            return table.values[total_simulations];
+        }
+        return std::log((float) total_simulations);
+    }
+
+    // Children are scored as many at a time as fit in one register: eight
+    // in a build for AVX, four with the SSE2 every x86-64 has. Wider
+    // vectors than the target has get their comparisons split into one
+    // branch per lane. The width is fixed per build, so the x86-64-v3
+    // clones of select_index still score four children at a time.
+#ifdef __AVX__
+    const uint8_t score_width = 8;
+#else
+    const uint8_t score_width = 4;
+#endif
+
+    typedef float score_lanes_t __attribute__((vector_size(4 * score_width)));
+    typedef int32_t index_lanes_t __attribute__((vector_size(4 * score_width)));
+    typedef uint8_t proof_lanes_t __attribute__((vector_size(score_width)));
+
+    // 1/sqrt(x) from the exponent trick and two Newton steps, which leaves
+    // a relative error below 5e-6. It only uses plain vector arithmetic, so
+    // every build picks the same children whatever instructions it targets.
+    inline score_lanes_t approximate_rsqrt(const score_lanes_t& x) {
+        score_lanes_t y = (score_lanes_t)(0x5f375a86 - ((index_lanes_t)x >> 1));
+        score_lanes_t half = x * 0.5f;
+        y = y * (1.5f - half * y * y);
+        return y * (1.5f - half * y * y);
+    }
+
+    // Takes a where mask is set and b elsewhere.
+    inline score_lanes_t blend(const index_lanes_t& mask,
+                               const score_lanes_t& a,
+                               const score_lanes_t& b) {
+        return (score_lanes_t)((mask & (index_lanes_t)a) | (~mask & (index_lanes_t)b));
+    }
+
+    inline index_lanes_t blend(const index_lanes_t& mask,
+                               const index_lanes_t& a,
+                               const index_lanes_t& b) {
+        return (mask & a) | (~mask & b);
+    }
+
+    // select_uct_scalar for score_width children at a time. The score is
+    // w/n + c*sqrt(ln(N)/n) = w*r*r + c*sqrt(ln(N))*r with r = 1/sqrt(n),
+    // and an unvisited child scores infinity, which makes the first of them
+    // win the ties just as the scalar loop returns it. With the error of
+    // approximate_rsqrt the child picked scores within 2e-5 (relative) of
+    // the one select_uct_scalar picks, and is the same one unless two
+    // children are that close.
+    //
+    // Children may be scored in several calls to score_children, in order
+    // of their indices, and the choice read with selected_child.
+    struct uct_selection {
+        float scale;
+        score_lanes_t best;
+        index_lanes_t best_index;
+    };
+
+    inline void start_selection(uct_selection& selection, uint32_t total_simulations) {
+        selection.scale = exploration * std::sqrt(parent_log(total_simulations));
+        selection.best = score_lanes_t{};
+        selection.best_index = index_lanes_t{};
+    }
+
+    // Scores children [first, first + count), whose counts start at
+    // simulations and wins and proofs, if there are any, at proofs. The
+    // arrays are read in whole groups of score_width, which child blocks
+    // are padded to. In a shared tree other workers update the counts while
+    // they are read; each aligned count is still read whole.
+    inline void score_children(uct_selection& selection,
+                               const uint32_t* simulations,
+                               const uint32_t* wins,
+                               uint16_t first,
+                               uint16_t count,
+                               const uint8_t* proofs = 0) {
+        const score_lanes_t unvisited_score = score_lanes_t{} + INFINITY;
+        const score_lanes_t lost_score = score_lanes_t{} - INFINITY;
+        index_lanes_t lanes;
+        for (uint8_t i = 0; i < score_width; i++) {
+            lanes[i] = first + i;
+        }
+        for (uint16_t i = 0; i < count; i += score_width) {
+            index_lanes_t index = lanes + i;
+            index_lanes_t valid = index < (int32_t)(first + count);
+            index_lanes_t visits, won;
+            std::memcpy(&visits, simulations + i, sizeof(visits));
+            std::memcpy(&won, wins + i, sizeof(won));
+            score_lanes_t r = approximate_rsqrt(__builtin_convertvector(visits, score_lanes_t));
+            score_lanes_t score = __builtin_convertvector(won, score_lanes_t) * r * r
+                + selection.scale * r;
+            score = blend(visits == 0, unvisited_score, score);
+            if (proofs) {
+                proof_lanes_t proof;
+                std::memcpy(&proof, proofs + i, sizeof(proof));
+                index_lanes_t lost = __builtin_convertvector(proof, index_lanes_t);
+                score = blend(lost == (int32_t)proven_loss, lost_score, score);
+            }
+            index_lanes_t better = valid & (score > selection.best);
+            selection.best = blend(better, score, selection.best);
+            selection.best_index = blend(better, index, selection.best_index);
+        }
+    }
+
+    // Returns whether the child picked is an unvisited one.
+    inline bool selected_child(const uct_selection& selection, uint16_t& child) {
+        uint8_t lane = 0;
+        for (uint8_t i = 1; i < score_width; i++) {
+            if (selection.best[i] > selection.best[lane]
+                || (selection.best[i] == selection.best[lane]
+                    && selection.best_index[i] < selection.best_index[lane])) {
+                lane = i;
+            }
+        }
+        child = selection.best_index[lane];
+        return selection.best[lane] == INFINITY;
+    }
+
+    inline uint16_t select_uct(const uint32_t* simulations,
+                               const uint32_t* wins,
+                               uint16_t number_of_choices,
+                               uint32_t total_simulations) {
+        uct_selection selection;
+        start_selection(selection, total_simulations);
+        score_children(selection, simulations, wins, 0, number_of_choices);
+        uint16_t child;
+        selected_child(selection, child);
+        return child;
+    }
+
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace bot {
+
+    // CPUs granted by a CFS quota, rounded up, or 0 when there is no quota.
+    // cgroup v2 keeps quota and period together in cpu.max, v1 in two files.
+    inline uint32_t cgroup_cpu_limit() {
+        std::ifstream cpu_max("/sys/fs/cgroup/cpu.max");
+        std::string quota;
+        uint64_t period = 0;
+        if (cpu_max >> quota >> period) {
+            if (quota == "max" || period == 0) {
+                return 0;
+            }
+            return (std::stoull(quota) + period - 1) / period;
+        }
+        std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        int64_t quota_us = 0;
+        int64_t period_us = 0;
+        if (quota_file >> quota_us && period_file >> period_us && quota_us > 0 && period_us > 0) {
+            return (quota_us + period_us - 1) / period_us;
+        }
+        return 0;
+    }
+
+    // The CPUs this process may run on, further capped by the container's
+    // quota. hardware_concurrency counts every CPU of the host, which is
+    // too many inside a cpuset or a quota.
+    inline uint32_t available_cpus() {
+        uint32_t cpus = std::thread::hardware_concurrency();
+#ifdef __linux__
+        cpu_set_t affinity;
+        if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0) {
+            cpus = CPU_COUNT(&affinity);
+        }
+#endif
+        uint32_t limit = cgroup_cpu_limit();
+        if (limit != 0) {
+            cpus = std::min(cpus, limit);
+        }
+        return std::max<uint32_t>(cpus, 1);
+    }
+
+    struct task_queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // A fixed set of threads, each with its own queue. A thread runs the
+    // newest task of its own queue first and, once that is empty, steals
+    // the oldest task of another thread's queue. submit deals tasks out
+    // round robin. Queues are guarded by their own mutex; tasks here are
+    // whole searches, so the locking never shows up next to the work.
+    struct worker_pool {
+        uint8_t size;
+        std::unique_ptr<task_queue[]> queues;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        uint32_t queued;
+        uint32_t unfinished;
+        uint32_t next_queue;
+        bool shutdown;
+
+        explicit worker_pool(uint8_t size)
+            : size(size), queues(new task_queue[size]),
+              queued(0), unfinished(0), next_queue(0), shutdown(false) {
+        }
+    };
+
+    inline bool take_task(worker_pool& pool, uint8_t worker, std::function<void()>& task) {
+        for (uint8_t i = 0; i < pool.size; i++) {
+            task_queue& queue = pool.queues[(worker + i) % pool.size];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    inline void run_pool_worker(worker_pool& pool, uint8_t worker) {
+        for (;;) {
+            std::function<void()> task;
+            if (take_task(pool, worker, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(pool.mutex);
+                    pool.queued--;
+                }
+                task();
+                std::lock_guard<std::mutex> lock(pool.mutex);
+                if (--pool.unfinished == 0) {
+                    pool.idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.wake.wait(lock, [&] { return pool.shutdown || pool.queued != 0; });
+            if (pool.shutdown && pool.queued == 0) {
+                return;
+            }
+        }
+    }
+
+    inline void start_pool(worker_pool& pool) {
+        for (uint8_t i = 0; i < pool.size; i++) {
+            pool.threads.emplace_back(run_pool_worker, std::ref(pool), i);
+        }
+    }
+
+    inline void submit(worker_pool& pool, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            task_queue& queue = pool.queues[pool.next_queue++ % pool.size];
+            {
+                std::lock_guard<std::mutex> queue_lock(queue.mutex);
+                queue.tasks.push_back(std::move(task));
+            }
+            pool.unfinished++;
+            pool.queued++;
+        }
+        pool.wake.notify_one();
+    }
+
+    inline void wait_for_tasks(worker_pool& pool) {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        pool.idle.wait(lock, [&] { return pool.unfinished == 0; });
+    }
+
+    // Returns whether every task finished before time.
+    template <typename time_point_t>
+    bool wait_for_tasks_until(worker_pool& pool, time_point_t time) {
+        std::unique_lock<std::mutex> lock(pool.mutex);
+        return pool.idle.wait_until(lock, time, [&] { return pool.unfinished == 0; });
+    }
+
+    // Lets the threads finish whatever is still queued, then joins them.
+    inline void stop_pool(worker_pool& pool) {
+        {
+            std::lock_guard<std::mutex> lock(pool.mutex);
+            pool.shutdown = true;
+        }
+        pool.wake.notify_all();
+        for (std::thread& thread : pool.threads) {
+            thread.join();
+        }
+        pool.threads.clear();
+    }
+
+}
+
+#endif